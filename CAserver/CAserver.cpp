@@ -1,3 +1,4 @@
+#include <array>
 #include <memory>
 #include <signal.h>
 #include <stdexcept>
@@ -10,11 +11,17 @@
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <mutex>
+#include <thread>
 
 #include <openssl/bio.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 
+#include "../common/http_parser.hpp"
+#include "../common/request_schema.hpp"
+#include "../common/logger.hpp"
+
 // sudo apt install whois
 
 namespace my {
@@ -76,74 +83,15 @@ namespace my {
         throw std::runtime_error(std::string(message) + "\n" + std::move(bio).str());
     }
 
-    std::string receive_some_data(BIO *bio)
-    {
-        char buffer[1024];
-        int len = BIO_read(bio, buffer, sizeof(buffer));
-        if (len < 0) {
-            my::print_errors_and_throw("error in BIO_read");
-        } else if (len > 0) {
-            return std::string(buffer, len);
-        } else if (BIO_should_retry(bio)) {
-            return receive_some_data(bio);
-        } else {
-            my::print_errors_and_throw("empty BIO_read");
-        }
-    }
-
-    std::vector<std::string> split_headers(const std::string& text)
-    {
-        std::vector<std::string> lines;
-        const char *start = text.c_str();
-        while (const char *end = strstr(start, "\r\n")) {
-            lines.push_back(std::string(start, end));
-            start = end + 2;
-        }
-        return lines;
-    }
-
-    std::string receive_http_message(BIO *bio)
-    {
-        std::string headers = my::receive_some_data(bio);
-        char *end_of_headers = strstr(&headers[0], "\r\n\r\n");
-        while (end_of_headers == nullptr) {
-            headers += my::receive_some_data(bio);
-            end_of_headers = strstr(&headers[0], "\r\n\r\n");
-        }
-        std::string body = std::string(end_of_headers+4, &headers[headers.size()]);
-        headers.resize(end_of_headers+2 - &headers[0]);
-        size_t content_length = -1;
-        for (const std::string& line : my::split_headers(headers)) {
-            if (const char *colon = strchr(line.c_str(), ':')) {
-                auto header_name = std::string(&line[0], colon);
-                if (header_name == "Content-Length") {
-                    content_length = std::stoul(colon+1);
-                }
-            }
-        }
-        if (content_length == -1) {
-            my::print_errors_and_throw("empty header or no content length.");
-        } 
-        while (body.size() < content_length) {
-            body += my::receive_some_data(bio);
-        }
-        if (content_length != body.size()) {
-            my::print_errors_and_throw("content length does not match.");
-        }
-        std::cout << "========start========" << std::endl;
-        std::cout << headers + "\r\n" + body << std::endl;
-        std::cout << "=========end=========" << std::endl;
-        return headers + "\r\n" + body;
-    }
-
     void send_http_response(BIO *bio, const std::string& body)
     {
         std::string response = "HTTP/1.1 200 OK\r\n";
         response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
         response += "\r\n";
+        // One write, so head and body share a TLS record.
+        response += body;
 
         BIO_write(bio, response.data(), response.size());
-        BIO_write(bio, body.data(), body.size());
         BIO_flush(bio);
     }
 
@@ -222,23 +170,9 @@ namespace my {
 
 } // namespace my
 
-std::vector<std::string> splitStringBy(std::string s, std::string delimiter) {
-    std::vector<std::string> splitted;
-    std::string unparsed(s);
-    size_t pos = 0;
-    std::string token;
-    while ((pos = unparsed.find(delimiter)) != std::string::npos) {
-        token = unparsed.substr(0, pos);
-        splitted.push_back(token);
-        unparsed.erase(0, pos + delimiter.length());
-    }
-    splitted.push_back(unparsed);
-    return splitted;
-}
-
 std::string getSailtFromHash(std::string hashedPw) {
-    std::vector<std::string> tokens = splitStringBy(hashedPw, "$");
-    return tokens[2];
+    std::vector<my::TextView> tokens = my::split(hashedPw, "$");
+    return tokens[2].str();
 }
 
 std::map<std::string, std::string> load_config()
@@ -260,13 +194,141 @@ std::map<std::string, std::string> load_config()
     return config_map;
 }
 
+// The CSR that follows the parameters line of a getcert or changepw.
+std::string request_csr(const std::vector<my::TextView>& requestLines)
+{
+    std::string csr = "";
+    for (size_t i = 6; i < requestLines.size(); i ++) {
+        csr.append(requestLines[i].data, requestLines[i].size);
+    }
+    return csr;
+}
+
+void handle_getcert(BIO *bio, const my::GetCertRequest& getcert, const std::vector<my::TextView>& requestLines,
+                    std::map<std::string, std::string>& password_db)
+{
+    std::string username = getcert.username.str();
+    my::save_csr_to_tmp(username, request_csr(requestLines));
+    my::log(my::LOG_INFO) << "getcert request received from user " << username;
+    if (password_db.find(username) == password_db.end()) {
+        my::log(my::LOG_INFO) << username + " not in system, rejected";
+        my::send_http_response(bio, "user not in system.\n");
+    } else {
+        std::string salt = getSailtFromHash(password_db[username]);
+        std::string hashedPassword = my::hash_password(salt, getcert.password.str());
+        if (password_db[username].compare(hashedPassword) != 0) {
+            my::log(my::LOG_INFO) << "wrong password supplied.";
+            my::send_http_response(bio, "incorrect password.\n");
+        } else {
+            my::sign_certificate(username, "tmp/" + username + ".csr.pem");
+            my::log(my::LOG_DEBUG) << "../ca/intermediate/certs/" + username + ".cert.pem";
+            my::send_http_response(bio,
+                                   my::read_certificate("../ca/intermediate/certs/" + username +
+                                                        ".cert.pem"));
+        }
+    }
+}
+
+void handle_changepw(BIO *bio, const my::ChangePwRequest& changepw, const std::vector<my::TextView>& requestLines,
+                     std::map<std::string, std::string>& password_db)
+{
+    std::string username = changepw.username.str();
+    my::save_csr_to_tmp(username, request_csr(requestLines));
+    my::log(my::LOG_INFO) << "changepw request received from user " << username;
+    if (password_db.find(username) == password_db.end()) {
+        my::log(my::LOG_INFO) << "user not in system.";
+        my::send_http_response(bio, "failed request.\n");
+    } else {
+        std::string salt = getSailtFromHash(password_db[username]);
+        std::string hashedOldPw = my::hash_password(salt, changepw.old_password.str());
+        if (hashedOldPw.compare(password_db[username]) != 0) {
+            my::log(my::LOG_INFO) << "old password incorrect.";
+            my::send_http_response(bio, "failed request.\n");
+        } else {
+            my::sign_certificate(username, "tmp/" + username + ".csr.pem");
+            my::log(my::LOG_INFO) << "change password success.";
+            password_db[username] = my::hash_password(salt, changepw.new_password.str());
+            my::save_password_database(password_db);
+            my::send_http_response(bio,
+                                   my::read_certificate("../ca/intermediate/certs/" + username +
+                                                        ".cert.pem"));
+        }
+    }
+}
+
+// Reads the parameters handler takes into its request struct and calls it,
+// or refuses the request if one it needs is missing.
+template<class Request>
+void dispatch(void (*handler)(BIO*, const Request&, const std::vector<my::TextView>&, std::map<std::string, std::string>&),
+              BIO *bio, const my::FormParams& paramMap, const std::vector<my::TextView>& requestLines,
+              std::map<std::string, std::string>& password_db)
+{
+    Request request;
+    if (!my::parse_request(paramMap, request)) {
+        my::log(my::LOG_INFO) << "missing request parameters, rejected";
+        my::send_http_response(bio, "failed request.\n");
+        return;
+    }
+    handler(bio, request, requestLines, password_db);
+}
+
+// Handles one request from the mail server. Callers hold ca_mutex, since
+// the password database and the openssl ca index are shared.
+void handle_request(BIO *bio, const std::string& request, std::map<std::string, std::string>& password_db)
+{
+    my::log(my::LOG_DEBUG) << "Got request";
+    std::vector<my::TextView> requestLines = my::split(request, "\r\n");
+    my::FormParams paramMap(requestLines.size() > 5 ? requestLines[5] : my::TextView());
+
+    switch (my::request_type_of(paramMap["type"])) {
+    case my::RequestType::GETCERT:
+        dispatch(handle_getcert, bio, paramMap, requestLines, password_db);
+        break;
+    case my::RequestType::CHANGEPW:
+        dispatch(handle_changepw, bio, paramMap, requestLines, password_db);
+        break;
+    default:
+        my::send_http_response(bio, "unimplemented request type\n");
+        break;
+    }
+}
+
+// Serves requests on one mail server connection until it is closed, so the
+// mail server can keep its connections to us open between requests.
+void serve_connection(my::UniquePtr<BIO> bio, std::map<std::string, std::string>& password_db, std::mutex& ca_mutex)
+{
+    while (true) {
+        std::string request;
+        try {
+            request = my::receive_http_message(bio.get());
+        } catch (const std::exception&) {
+            // the mail server closed the connection
+            return;
+        }
+        // Every request carries a password, so only its size is logged.
+        my::log(my::LOG_TRACE).field("request_bytes", request.size());
+        try {
+            std::lock_guard<std::mutex> lock(ca_mutex);
+            handle_request(bio.get(), request, password_db);
+        } catch (const std::exception& ex) {
+            my::log(my::LOG_ERROR) << "Worker exited with exception: " << ex.what();
+            return;
+        }
+    }
+}
+
 int main()
 {
+    std::map<std::string, std::string> configMap = load_config();
+    my::LogLevel log_level;
+    if (configMap.count("log_level") && my::parse_log_level(configMap["log_level"], log_level)) {
+        my::set_log_level(log_level);
+    }
 
     std::map<std::string, std::string> password_db = my::load_password_database();
-    std::cout << "loading users from database..." << std::endl;
+    my::log(my::LOG_INFO) << "loading users from database...";
     for(auto itr = password_db.begin(); itr != password_db.end(); itr++) {
-        std::cout << itr->first << std::endl;
+        my::log(my::LOG_INFO) << itr->first;
     }
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
@@ -285,9 +347,9 @@ int main()
         my::print_errors_and_exit("Error loading server private key");
     }
 
-    std::map<std::string, std::string> configMap = load_config();
-
     auto accept_bio = my::UniquePtr<BIO>(BIO_new_accept(configMap["CAserver_port"].c_str()));
+    // Allow a restart while the mail server's old connections are in TIME_WAIT.
+    BIO_set_bind_mode(accept_bio.get(), BIO_BIND_REUSEADDR);
     if (BIO_do_accept(accept_bio.get()) <= 0) {
         my::print_errors_and_exit("Error in BIO_do_accept");
     }
@@ -296,83 +358,15 @@ int main()
         close(fd);
     };
     signal(SIGINT, [](int) { shutdown_the_socket(); });
+    // A write to a connection the peer has closed must fail, not kill the server.
+    signal(SIGPIPE, SIG_IGN);
+    std::mutex ca_mutex;
     while (auto bio = my::accept_new_tcp_connection(accept_bio.get())) {
         bio = std::move(bio)
               | my::UniquePtr<BIO>(BIO_new_ssl(ctx.get(), 0))
                 ;
-        try {
-            std::string request = my::receive_http_message(bio.get());
-            printf("Got request:\n");
-            std::vector<std::string> requestLines = splitStringBy(request, "\r\n");
-            std::map<std::string, std::string> paramMap;
-            std::vector<std::string> params = splitStringBy(requestLines[5], "&");
-            for (int i = 0; i < params.size(); i ++) {
-                std::vector <std::string> kv = splitStringBy(params[i], "=");
-                paramMap[kv[0]] = kv[1];
-            }
-
-            if (paramMap["type"].compare("getcert") == 0) {
-                std::string csr = "";
-                for (int i = 6; i < requestLines.size(); i ++) {
-                    csr += requestLines[i];
-                }
-                my::save_csr_to_tmp(paramMap["username"], csr);
-                std::cout << "getcert request received from user " << paramMap["username"] << std::endl;
-                std::cout << "provided password " + paramMap["password"] << std::endl;
-                if (password_db.find(paramMap["username"]) == password_db.end()) {
-                    std::cout << paramMap["username"] + " not in system, rejected" << std::endl;
-                    my::send_http_response(bio.get(), "user not in system.\n");
-                } else {
-                    std::string salt = getSailtFromHash(password_db[paramMap["username"]]);
-                    std::string hashedPassword = my::hash_password(salt, paramMap["password"]);
-                    if (password_db[paramMap["username"]].compare(hashedPassword) != 0) {
-                        std::cout << "hashed pw from database: " << password_db[paramMap["username"]] << std::endl;
-                        std::cout << "length: " << password_db[paramMap["username"]].size() << std::endl;
-                        std::cout << "hashed provided pw: " << hashedPassword << std::endl;
-                        std::cout << "length: " << hashedPassword.size() << std::endl;
-                        std::cout << "wrong password supplied." << std::endl;
-                        my::send_http_response(bio.get(), "incorrect password.\n");
-                    } else {
-                        my::sign_certificate(paramMap["username"], "tmp/" + paramMap["username"] + ".csr.pem");
-                        std::cout << "../ca/intermediate/certs/" + paramMap["username"] + ".cert.pem" << "\n";
-                        my::send_http_response(bio.get(),
-                                               my::read_certificate("../ca/intermediate/certs/" + paramMap["username"] +
-                                                                    ".cert.pem"));
-                    }
-                }
-            } else if (paramMap["type"].compare("changepw") == 0) {
-                std::string csr = "";
-                for (int i = 6; i < requestLines.size(); i ++) {
-                    csr += requestLines[i];
-                }
-                my::save_csr_to_tmp(paramMap["username"], csr);
-                std::cout << "changepw request received from user " << paramMap["username"] << std::endl;
-                std::cout << "provided old password " + paramMap["old_password"] << std::endl;
-                if (password_db.find(paramMap["username"]) == password_db.end()) {
-                    std::cout << "user not in system." << std::endl;
-                    my::send_http_response(bio.get(), "failed request.\n");
-                } else {
-                    std::string salt = getSailtFromHash(password_db[paramMap["username"]]);
-                    std::string hashedOldPw = my::hash_password(salt, paramMap["old_password"]);
-                    if (hashedOldPw.compare(password_db[paramMap["username"]]) != 0) {
-                        std::cout << "old password incorrect." << std::endl;
-                        my::send_http_response(bio.get(), "failed request.\n");
-                    } else {
-                        my::sign_certificate(paramMap["username"], "tmp/" + paramMap["username"] + ".csr.pem");
-                        std::cout << "change password success." << std::endl;
-                        password_db[paramMap["username"]] = my::hash_password(salt, paramMap["new_password"]);
-                        my::save_password_database(password_db);
-                        my::send_http_response(bio.get(),
-                                               my::read_certificate("../ca/intermediate/certs/" + paramMap["username"] +
-                                                                    ".cert.pem"));
-                    }
-                }
-            } else {
-                my::send_http_response(bio.get(), "unimplemented request type\n");
-            }
-        } catch (const std::exception& ex) {
-            printf("Worker exited with exception:\n%s\n", ex.what());
-        }
+        // Connections stay open, so each one gets its own thread.
+        std::thread(serve_connection, std::move(bio), std::ref(password_db), std::ref(ca_mutex)).detach();
     }
     printf("\nClean exit!\n");
 }
@@ -69,6 +69,7 @@ int main(int argc, char *argv[]) {
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
     SSL_set1_host(my::get_ssl(ssl_bio.get()), "duckduckgo.com");
 #endif
+    my::resume_session(my::get_ssl(ssl_bio.get()));
     if (BIO_do_handshake(ssl_bio.get()) <= 0) {
         my::print_errors_and_exit("Error in BIO_do_handshake");
     }
@@ -80,6 +81,7 @@ int main(int argc, char *argv[]) {
     std::string csr_content = read_csr("client_files/csr.pem");
     my::send_changepw_request(ssl_bio.get(), username, old_password, new_password, csr_content);
     std::string response = my::receive_http_message(ssl_bio.get());
+    my::save_session(my::get_ssl(ssl_bio.get()));
     std::string error_code = my::get_error_code_from_header(response);
     if (error_code != "200") {
         std::cout << response << std::endl;
@@ -91,6 +93,7 @@ int main(int argc, char *argv[]) {
         std::ofstream out("client_files/cert.pem");
         out << certificate;
         out.close();
+        my::forget_mtls_session();
         std::cout << "successfully got certificate, saved at client_files/cert.pem" << std::endl;
     } 
 }
@@ -8,16 +8,22 @@
 #include <vector>
 #include <iostream>
 #include <fstream>
+#include <initializer_list>
 #include <sstream>
 #include <assert.h>
 #include <map>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <openssl/bio.h>
 #include <openssl/err.h>
+#include <openssl/pem.h>
 #include <openssl/ssl.h>
 #include <openssl/x509v3.h>
 
+#include "../common/http_parser.hpp"
+
 namespace my {
 
     template<class T> struct DeleterOf;
@@ -77,76 +83,115 @@ namespace my {
         throw std::runtime_error(std::string(message) + "\n" + std::move(bio).str());
     }
 
-    std::string receive_some_data(BIO *bio)
+    void send_http_request(BIO *bio, const std::string& line, const std::string& host)
     {
-        char buffer[1024];
-        int len = BIO_read(bio, buffer, sizeof(buffer));
-        if (len < 0) {
-            my::print_errors_and_throw("error in BIO_read");
-        } else if (len > 0) {
-            return std::string(buffer, len);
-        } else if (BIO_should_retry(bio)) {
-            return receive_some_data(bio);
-        } else {
-            my::print_errors_and_throw("empty BIO_read");
-        }
-    }
+        std::string request = line + "\r\n";
+        request += "Host: " + host + "\r\n";
+        request += "\r\n";
 
-    std::vector<std::string> split_headers(const std::string& text)
-    {
-        std::vector<std::string> lines;
-        const char *start = text.c_str();
-        while (const char *end = strstr(start, "\r\n")) {
-            lines.push_back(std::string(start, end));
-            start = end + 2;
-        }
-        return lines;
+        BIO_write(bio, request.data(), request.size());
+        BIO_flush(bio);
     }
 
-    std::string receive_http_message(BIO *bio)
+    // A piece of a request body, pointing into a string or literal that
+    // outlives the call it is passed to.
+    struct Piece {
+        const char *data;
+        size_t size;
+
+        Piece(const std::string& s) : data(s.data()), size(s.size()) {}
+        Piece(const char *s) : data(s), size(strlen(s)) {}
+    };
+
+    // Pieces up to this size are copied in with what precedes them, so a
+    // request goes out as one TLS record and one write; larger ones, like a
+    // message, are written where they are.
+    const size_t copy_limit = 4096;
+
+    // Sends a POST request whose body is parts, back to back. The header
+    // and the small parts are gathered into one buffer and written once.
+    // If echo is given, the request is written there too.
+    void send_post_request(BIO *bio, std::initializer_list<Piece> parts, std::ostream *echo=nullptr)
     {
-        std::string headers = my::receive_some_data(bio);
-        char *end_of_headers = strstr(&headers[0], "\r\n\r\n");
-        while (end_of_headers == nullptr) {
-            headers += my::receive_some_data(bio);
-            end_of_headers = strstr(&headers[0], "\r\n\r\n");
+        size_t bodylen = 0;
+        for (const Piece& part : parts) {
+            bodylen += part.size;
         }
-        std::string body = std::string(end_of_headers+4, &headers[headers.size()]);
-        headers.resize(end_of_headers+2 - &headers[0]);
-        size_t content_length = 0;
-        for (const std::string& line : my::split_headers(headers)) {
-            if (const char *colon = strchr(line.c_str(), ':')) {
-                auto header_name = std::string(&line[0], colon);
-                if (header_name == "Content-Length") {
-                    content_length = std::stoul(colon+1);
-                }
+        char length[32];
+        std::string request;
+        request += "POST / HTTP/1.1\r\n";
+        request += "Host: duckduckgo.com\r\n";
+        request += "Content-Type: application/octet-stream\r\n";
+        request += "Content-Length: ";
+        request.append(length, snprintf(length, sizeof(length), "%zu", bodylen));
+        request += "\r\n\r\n";
+        if (echo != nullptr) {
+            *echo << request;
+            for (const Piece& part : parts) {
+                echo->write(part.data, part.size);
             }
         }
-        while (body.size() < content_length) {
-            body += my::receive_some_data(bio);
+        for (const Piece& part : parts) {
+            if (part.size <= copy_limit) {
+                request.append(part.data, part.size);
+                continue;
+            }
+            BIO_write(bio, request.data(), request.size());
+            BIO_write(bio, part.data, part.size);
+            request.clear();
         }
-        return headers + "\r\n" + body;
+        if (!request.empty()) {
+            BIO_write(bio, request.data(), request.size());
+        }
+        BIO_flush(bio);
     }
+    
+    // A named field of a frame.
+    struct FrameField {
+        Piece name;
+        Piece value;
+    };
 
-    void send_http_request(BIO *bio, const std::string& line, const std::string& host)
+    void append_size(std::string& out, size_t size, int bytes)
     {
-        std::string request = line + "\r\n";
-        request += "Host: " + host + "\r\n";
-        request += "\r\n";
+        for (int shift = 8 * (bytes - 1); shift >= 0; shift -= 8) {
+            out += static_cast<char>((size >> shift) & 0xff);
+        }
+    }
 
-        BIO_write(bio, request.data(), request.size());
+    // Sends fields as one frame: the magic "\0MF1", the 4 byte big-endian
+    // size of the rest, then each field as a 2 byte name size, the name, a
+    // 4 byte value size and the value. Values are sent as is, so binary
+    // parts need no escaping and cannot be cut short by a "\r\n" inside
+    // them. Like send_post_request, small values are gathered with the
+    // sizes and names and large ones are written where they are.
+    void send_frame(BIO *bio, std::initializer_list<FrameField> fields)
+    {
+        std::string frame;
+        size_t rest = 0;
+        for (const FrameField& field : fields) {
+            rest += 2 + field.name.size + 4 + field.value.size;
+        }
+        frame.append("\0MF1", 4);
+        append_size(frame, rest, 4);
+        for (const FrameField& field : fields) {
+            append_size(frame, field.name.size, 2);
+            frame.append(field.name.data, field.name.size);
+            append_size(frame, field.value.size, 4);
+            if (field.value.size <= copy_limit) {
+                frame.append(field.value.data, field.value.size);
+                continue;
+            }
+            BIO_write(bio, frame.data(), frame.size());
+            BIO_write(bio, field.value.data, field.value.size);
+            frame.clear();
+        }
+        if (!frame.empty()) {
+            BIO_write(bio, frame.data(), frame.size());
+        }
         BIO_flush(bio);
     }
 
-    std::string generate_header(size_t bodylen) {
-        std::string request = "POST / HTTP/1.1\r\n";
-        request += "Host: duckduckgo.com\r\n";
-        request += "Content-Type: application/octet-stream\r\n";
-        request += "Content-Length: " + std::to_string(bodylen) + "\r\n";
-        request += "\r\n";
-        return request;
-    }
-    
     void check_body(std::string & body) {
         if (body.size() < 4 || body.substr(body.size() - 4, 4) != "\r\n\r\n")
             body += "\r\n\r\n";
@@ -157,15 +202,10 @@ namespace my {
                               const std::string& password,
                               const std::string& csr_content)
     {
-        std::string fields = "type=getcert&username=" + username + "&password=" + password;
-        std::string body = fields + "\r\n" + csr_content;
-        // check_body(body); When sending cert, we do not add \r\n at the end.
-        std::string request = my::generate_header(body.size()) + body;
-
-        std::cout << request << std::endl;
-
-        BIO_write(bio, request.data(), request.size());
-        BIO_flush(bio);
+        // When sending cert, we do not add \r\n at the end.
+        my::send_post_request(bio, {"type=getcert&username=", username, "&password=", password, "\r\n", csr_content},
+                              &std::cout);
+        std::cout << std::endl;
     }
 
     void send_changepw_request(BIO *bio,
@@ -174,27 +214,18 @@ namespace my {
                                const std::string& new_password,
                                const std::string& csr_content)
     {
-        std::string fields = "type=changepw&username=" + username + "&old_password=" + old_password + "&new_password=";
-        fields += new_password;
-        std::string body = fields + "\r\n" + csr_content;
-        // check_body(body); When sending cert, we do not add \r\n at the end.
-        std::string request = my::generate_header(body.size()) + body;
-        std::cout << request << std::endl;
-
-        BIO_write(bio, request.data(), request.size());
-        BIO_flush(bio);
+        // When sending cert, we do not add \r\n at the end.
+        my::send_post_request(bio, {"type=changepw&username=", username, "&old_password=", old_password,
+                                    "&new_password=", new_password, "\r\n", csr_content}, &std::cout);
+        std::cout << std::endl;
     }
 
     void send_certificate(BIO *bio, const std::string & cert_path, const std::string & request_type) {
         std::ifstream cert(cert_path.c_str(), std::ios::binary);
         std::string c((std::istreambuf_iterator<char>(cert)), std::istreambuf_iterator<char>());
         cert.close();
-        std::string fields = "type=" + request_type;
-        std::string body = fields + "\r\n" + c;
-        // check_body(body); When sending cert, we do not add \r\n at the end.
-        std::string request = my::generate_header(body.size()) + body;
-        BIO_write(bio, request.data(), request.size());
-        BIO_flush(bio);
+        // When sending cert, we do not add \r\n at the end.
+        my::send_post_request(bio, {"type=", request_type, "\r\n", c});
     }
 
     std::string get_error_code_from_header(const std::string & header) {
@@ -216,8 +247,7 @@ namespace my {
         std::string temp;
         std::getline(ss,temp);
         std::string ret = get_error_code_from_header(temp);
-        std::getline(ss,temp);
-        std::getline(ss,temp);
+        while (std::getline(ss,temp) && temp != "\r"); // skip the headers
         std::ofstream rbody(loc.c_str(), std::ofstream::binary);
         rbody << ss.rdbuf();
         rbody.close();
@@ -227,23 +257,18 @@ namespace my {
     void send_number(BIO *bio, const std::string & number) {
         std::string fields = number;
         check_body(fields);
-        std::string request = my::generate_header(fields.size());
-        request += fields;
-        BIO_write(bio, request.data(), request.size());
-        BIO_flush(bio);
+        my::send_post_request(bio, {fields});
     }
 
     void send_number_and_recipient(BIO *bio,
                                    const std::string & number,
                                    std::vector<std::string> recipients) {
         std::string fields = number;
-        for (int i = 0; i < recipients.size(); i++) {
+        for (size_t i = 0; i < recipients.size(); i++) {
             fields += " " + recipients[i];
         }
         check_body(fields);
-        std::string request = my::generate_header(fields.size()) + fields;
-        BIO_write(bio, request.data(), request.size());
-        BIO_flush(bio);
+        my::send_post_request(bio, {fields});
     }
 
     void check_response(const std::string & loc, std::string error_code) {
@@ -293,6 +318,121 @@ namespace my {
 #endif
     }
 
+    // The TLS session of the last run is kept in client_files/, so the next run
+    // can resume it (a TLS 1.3 PSK handshake) instead of doing a full one.
+    // A session set up with a client certificate resumes as that certificate,
+    // so those are kept apart from the ones set up without.
+    const std::string session_path = "client_files/session.pem";
+    const std::string mtls_session_path = "client_files/session.mtls.pem";
+
+    const std::string& session_path_for(SSL *ssl)
+    {
+        return SSL_get_certificate(ssl) != nullptr ? mtls_session_path : session_path;
+    }
+
+    // Presents client_files/cert.pem during the handshake (mtls: on in the
+    // config), so a server with client_auth on can skip the number challenge.
+    void use_client_certificate(SSL_CTX *ctx)
+    {
+        if (SSL_CTX_use_certificate_file(ctx, "client_files/cert.pem", SSL_FILETYPE_PEM) <= 0
+            || SSL_CTX_use_PrivateKey_file(ctx, "client_files/key.pem", SSL_FILETYPE_PEM) <= 0) {
+            my::print_errors_and_exit("Error loading client certificate");
+        }
+    }
+
+    // Called once a new certificate has been saved: the saved mTLS session
+    // would still present the old one.
+    void forget_mtls_session()
+    {
+        remove(mtls_session_path.c_str());
+    }
+
+    // Offers the saved session on a connection that has not done its
+    // handshake yet. A server that does not know the session (e.g. because
+    // it restarted) simply does a full handshake instead.
+    void resume_session(SSL *ssl)
+    {
+        FILE *f = fopen(session_path_for(ssl).c_str(), "r");
+        if (f == nullptr) {
+            return;
+        }
+        SSL_SESSION *session = PEM_read_SSL_SESSION(f, nullptr, nullptr, nullptr);
+        fclose(f);
+        if (session == nullptr) {
+            ERR_clear_error();
+            return;
+        }
+        if (SSL_SESSION_is_resumable(session)) {
+            SSL_set_session(ssl, session);
+        }
+        SSL_SESSION_free(session);
+    }
+
+    // Saves the newest session the server has issued on this connection. In
+    // TLS 1.3 the ticket arrives after the handshake, so call this once a
+    // response has been read. The file holds a resumption secret, so only
+    // the user may read it.
+    void save_session(SSL *ssl)
+    {
+        SSL_SESSION *session = SSL_get1_session(ssl);
+        if (session == nullptr) {
+            return;
+        }
+        if (SSL_SESSION_is_resumable(session)) {
+            int fd = open(session_path_for(ssl).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            FILE *f = fd < 0 ? nullptr : fdopen(fd, "w");
+            if (f != nullptr) {
+                PEM_write_SSL_SESSION(f, session);
+                fclose(f);
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+        SSL_SESSION_free(session);
+    }
+
+    // After passing the number challenge the server hands out a token that
+    // stands in for it for a few minutes; it is kept here between runs.
+    const std::string token_path = "client_files/token";
+
+    std::string load_token()
+    {
+        std::ifstream f(token_path);
+        std::string token;
+        f >> token;
+        return token;
+    }
+
+    // Keeps the token from the Token header of response, if it has one.
+    void save_token(const std::string& response)
+    {
+        size_t end_of_headers = response.find("\r\n\r\n");
+        size_t start = response.find("\r\nToken: ");
+        if (start == std::string::npos || start >= end_of_headers) {
+            return;
+        }
+        start += 9;
+        std::string token = response.substr(start, response.find("\r\n", start) - start);
+        int fd = open(token_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd >= 0) {
+            write(fd, token.data(), token.size());
+            close(fd);
+        }
+    }
+
+    void forget_token()
+    {
+        remove(token_path.c_str());
+    }
+
+    // Whether the server turned the token down; the conversation is still
+    // open, so the client goes on with the number challenge.
+    bool token_rejected(const std::string& response)
+    {
+        std::string body = "\r\n\r\nbad-token";
+        return response.size() >= body.size() && response.compare(response.size() - body.size(), body.size(), body) == 0;
+    }
+
     std::map<std::string, std::string> load_config()
     {
         std::map<std::string, std::string> config_map;
@@ -314,7 +454,7 @@ namespace my {
 
     bool is_username_valid(std::string username)
     {
-        for (int i = 0; i < username.size(); i ++) {
+        for (size_t i = 0; i < username.size(); i ++) {
             if (!islower(username.c_str()[i])) {
                 return false;
             }
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <array>
 #include <cstdio>
 #include <string>
 #include <fstream>
@@ -100,9 +101,14 @@ void check_and_decrypt(string key_file, string id_mail_file, string sign_file,
 
 int main(int argc, char *argv[]){
 
-    if (argc != 1) {
+    // with --wait, an empty mailbox makes the server hold the request until
+    // mail arrives (or SECONDS pass) instead of answering right away
+    std::string wait_param;
+    if (argc == 3 && std::string(argv[1]) == "--wait" && atoi(argv[2]) > 0) {
+        wait_param = "&wait=" + std::to_string(atoi(argv[2]));
+    } else if (argc != 1) {
         std::cerr << "Invalid number of arguments." << std::endl;
-        std::cerr << "Usage: ./recvmsg" << std::endl;
+        std::cerr << "Usage: ./recvmsg [--wait SECONDS]" << std::endl;
         return 1;
     }
 
@@ -140,6 +146,10 @@ int main(int argc, char *argv[]){
     // load config
     std::map<std::string, std::string> config_map = my::load_config();
     std::string server_url = config_map["server_ip"] + ":" + config_map["server_port"];
+    bool mtls = config_map["mtls"] == "on";
+    if (mtls) {
+        my::use_client_certificate(ctx.get());
+    }
 
     // Change this line to connects to real duckduckgo
     // auto bio = my::UniquePtr<BIO>(BIO_new_connect("duckduckgo.com:443"));
@@ -157,6 +167,7 @@ int main(int argc, char *argv[]){
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
     SSL_set1_host(my::get_ssl(ssl_bio.get()), "duckduckgo.com");
 #endif
+    my::resume_session(my::get_ssl(ssl_bio.get()));
     if (BIO_do_handshake(ssl_bio.get()) <= 0) {
         my::print_errors_and_exit("Error in BIO_do_handshake");
     }
@@ -164,18 +175,38 @@ int main(int argc, char *argv[]){
 
     /***************** connection established ***********************/
 
-    my::send_certificate(ssl_bio.get(), cert_path, "recvmsg");
-
-    string response = my::receive_http_message(ssl_bio.get());
-    std::string error_code = my::get_body_and_store(response, "tmp/sav.number.enc");
-    my::check_response("tmp/sav.number.enc", error_code);
-    string number = exec("openssl pkeyutl -decrypt -inkey " + key_path + " -in tmp/sav.number.enc");
-    cout << number << endl;
-    my::send_number(ssl_bio.get(), number); // send decrypted number to server
-    
-    response = my::receive_http_message(ssl_bio.get()); // get key.enc
+    string response;
+    string token = my::load_token();
+    if (mtls || !token.empty()) {
+        // the handshake or the token proves who we are, so the message comes right away
+        if (mtls) {
+            my::send_post_request(ssl_bio.get(), {"type=recvmsg&auth=tls", wait_param, "\r\n"});
+        } else {
+            my::send_post_request(ssl_bio.get(), {"type=recvmsg&auth=token&token=", token, wait_param, "\r\n"});
+        }
+        response = my::receive_http_message(ssl_bio.get()); // get key.enc
+        my::save_session(my::get_ssl(ssl_bio.get()));
+        if (!mtls && my::token_rejected(response)) {
+            my::forget_token();
+            response.clear();
+        }
+    }
+    if (response.empty()) {
+        my::send_certificate(ssl_bio.get(), cert_path, "recvmsg" + wait_param);
+
+        response = my::receive_http_message(ssl_bio.get());
+        my::save_session(my::get_ssl(ssl_bio.get()));
+        std::string error_code = my::get_body_and_store(response, "tmp/sav.number.enc");
+        my::check_response("tmp/sav.number.enc", error_code);
+        string number = exec("openssl pkeyutl -decrypt -inkey " + key_path + " -in tmp/sav.number.enc");
+        cout << number << endl;
+        my::send_number(ssl_bio.get(), number); // send decrypted number to server
+
+        response = my::receive_http_message(ssl_bio.get()); // get key.enc
+        my::save_token(response);
+    }
     //cout << response << endl;
-    error_code = my::get_body_and_store(response, "tmp/sav.key.bin.enc");
+    std::string error_code = my::get_body_and_store(response, "tmp/sav.key.bin.enc");
     my::check_response("tmp/sav.key.bin.enc", error_code);
 
     response = my::receive_http_message(ssl_bio.get()); // get id_mail.enc
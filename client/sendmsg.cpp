@@ -1,4 +1,5 @@
 #include <iostream>
+#include <array>
 #include <cstdio>
 #include <string>
 #include <fstream>
@@ -33,14 +34,6 @@ string exec(const string& cmd) {
     return result;
 }
 
-void send_request(BIO *bio, string msg) {
-    msg += "\r\n\r\n";
-    string request = my::generate_header(msg.size());
-    request += msg;
-    BIO_write(bio, request.data(), request.size());
-    BIO_flush(bio);
-}
-
 void send_msg(BIO *bio, string recipient) {
     ifstream f1("tmp/key.bin.enc", ifstream::binary);
     string keyenc((std::istreambuf_iterator<char>(f1)), std::istreambuf_iterator<char>());
@@ -52,13 +45,11 @@ void send_msg(BIO *bio, string recipient) {
     string sg((std::istreambuf_iterator<char>(f3)), std::istreambuf_iterator<char>());
     f3.close();
 
-    send_request(bio, recipient);
-    my::receive_http_message(bio);
-    send_request(bio, keyenc);
-    my::receive_http_message(bio);
-    send_request(bio, idmail);
-    my::receive_http_message(bio);
-    send_request(bio, sg);
+    // recipient and all three parts in one frame; the server answers once
+    my::send_frame(bio, {{"recipient", recipient},
+                         {"key.bin.enc", keyenc},
+                         {"id_mail.enc", idmail},
+                         {"signature.sign", sg}});
 }
 
 /*
@@ -90,20 +81,6 @@ void generate_message(string username, unordered_map<string, int>& idmap) {
     system(("openssl dgst -sha256 -sign " + key_path + " -out tmp/signature.sign tmp/id_mail.enc").c_str());
 }
 
-std::vector<std::string> splitStringBy(std::string s, std::string delimiter) {
-    std::vector<std::string> splitted;
-    std::string unparsed(s);
-    size_t pos = 0;
-    std::string token;
-    while ((pos = unparsed.find(delimiter)) != std::string::npos) {
-        token = unparsed.substr(0, pos);
-        splitted.push_back(token);
-        unparsed.erase(0, pos + delimiter.length());
-    }
-    splitted.push_back(unparsed);
-    return splitted;
-}
-
 int main(int argc, const char * argv[]){
 
     if (argc < 3) {
@@ -180,6 +157,10 @@ int main(int argc, const char * argv[]){
     // load config
     std::map<std::string, std::string> config_map = my::load_config();
     std::string server_url = config_map["server_ip"] + ":" + config_map["server_port"];
+    bool mtls = config_map["mtls"] == "on";
+    if (mtls) {
+        my::use_client_certificate(ctx.get());
+    }
 
     // Change this line to connects to real duckduckgo
     // auto bio = my::UniquePtr<BIO>(BIO_new_connect("duckduckgo.com:443"));
@@ -197,6 +178,7 @@ int main(int argc, const char * argv[]){
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
     SSL_set1_host(my::get_ssl(ssl_bio.get()), "duckduckgo.com");
 #endif
+    my::resume_session(my::get_ssl(ssl_bio.get()));
     if (BIO_do_handshake(ssl_bio.get()) <= 0) {
         my::print_errors_and_exit("Error in BIO_do_handshake");
     }
@@ -204,27 +186,54 @@ int main(int argc, const char * argv[]){
     
     /***************** connection established ***********************/
 
-    my::send_certificate(ssl_bio.get(), cert_path, "sendmsg"); // send certificate to server
+    string response;
+    string names;
+    for (size_t i = 0; i < recipients.size(); i++) {
+        names += (i > 0 ? " " : "") + recipients[i];
+    }
+    string token = my::load_token();
+    if (mtls || !token.empty()) {
+        // the handshake or the token proves who we are, so the recipients go right away
+        if (mtls) {
+            my::send_post_request(ssl_bio.get(), {"type=sendmsg&auth=tls\r\n", names, "\r\n\r\n"});
+        } else {
+            my::send_post_request(ssl_bio.get(), {"type=sendmsg&auth=token&token=", token, "\r\n", names, "\r\n\r\n"});
+        }
+        response = my::receive_http_message(ssl_bio.get()); // get recipient's certificate
+        my::save_session(my::get_ssl(ssl_bio.get()));
+        if (!mtls && my::token_rejected(response)) {
+            my::forget_token();
+            response.clear();
+        } else {
+            std::string error_code = my::get_body_and_store(response, "tmp/recipients");
+            my::check_response("tmp/recipients", error_code);
+        }
+    }
+    if (response.empty()) {
+        my::send_certificate(ssl_bio.get(), cert_path, "sendmsg"); // send certificate to server
 
-    string response = my::receive_http_message(ssl_bio.get());
+        response = my::receive_http_message(ssl_bio.get());
+        my::save_session(my::get_ssl(ssl_bio.get()));
 
-    // first response, number expected, if fake identity, also stored in that file
-    std::string error_code = my::get_body_and_store(response, "tmp/number.enc");
-    my::check_response("tmp/number.enc", error_code);
+        // first response, number expected, if fake identity, also stored in that file
+        std::string error_code = my::get_body_and_store(response, "tmp/number.enc");
+        my::check_response("tmp/number.enc", error_code);
 
-    string number = exec("openssl pkeyutl -decrypt -inkey " + key_path + " -in tmp/number.enc");
-    cout << number << endl;
-    my::send_number_and_recipient(ssl_bio.get(), number, recipients); // send decrypted number to server
-    response = my::receive_http_message(ssl_bio.get()); // get recipient's certificate
+        string number = exec("openssl pkeyutl -decrypt -inkey " + key_path + " -in tmp/number.enc");
+        cout << number << endl;
+        my::send_number_and_recipient(ssl_bio.get(), number, recipients); // send decrypted number to server
+        response = my::receive_http_message(ssl_bio.get()); // get recipient's certificate
+        my::save_token(response);
+    }
 
     std::cout << response << std::endl;
 
-    std::vector<std::string> responseLines = splitStringBy(response, "\r\n");
+    std::vector<my::TextView> responseLines = my::split(response, "\r\n");
     std::vector<std::string> validRecipients;
-    int i = 3;
+    size_t i = std::find(responseLines.begin(), responseLines.end(), "") - responseLines.begin() + 1;
     while (i + 1 <= responseLines.size() - 1) {
-        std::string recipientName = responseLines[i];
-        std::string cert_content = responseLines[i + 1];
+        std::string recipientName = responseLines[i].str();
+        std::string cert_content = responseLines[i + 1].str();
         if (cert_content.find("-----BEGIN CERTIFICATE-----") != std::string::npos) {
             std::string cert_loc = "tmp/" + recipientName + ".cert.pem";
             std::ofstream rbody(cert_loc, std::ofstream::binary);
@@ -235,7 +244,7 @@ int main(int argc, const char * argv[]){
         i += 2;
     }
 
-    for (int i = 0; i < validRecipients.size(); i++) {
+    for (size_t i = 0; i < validRecipients.size(); i++) {
         std::cout << "attempting to deliver message to " << validRecipients[i] << std::endl;
         std::string command = "cp tmp/" + validRecipients[i] + ".cert.pem tmp/recipient.cert.pem";
         system(command.c_str());
@@ -0,0 +1,367 @@
+#include <algorithm>
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdexcept>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <openssl/bio.h>
+
+namespace my {
+
+    [[noreturn]] void print_errors_and_throw(const char *message);
+
+    // A run of bytes inside a message that outlives it.
+    struct TextView {
+        const char *data;
+        size_t size;
+
+        TextView() : data(""), size(0) {}
+        TextView(const char *data, size_t size) : data(data), size(size) {}
+        TextView(const char *s) : data(s), size(strlen(s)) {}
+        TextView(const std::string& s) : data(s.data()), size(s.size()) {}
+
+        std::string str() const { return std::string(data, size); }
+        bool empty() const { return size == 0; }
+        bool starts_with(const char *prefix) const {
+            size_t n = strlen(prefix);
+            return size >= n && memcmp(data, prefix, n) == 0;
+        }
+        bool operator==(TextView other) const {
+            return size == other.size && memcmp(data, other.data, size) == 0;
+        }
+        bool operator==(const char *s) const { return *this == TextView(s, strlen(s)); }
+        bool operator!=(TextView other) const { return !(*this == other); }
+        bool operator!=(const char *s) const { return !(*this == s); }
+    };
+
+    inline std::ostream& operator<<(std::ostream& out, TextView text)
+    {
+        return out.write(text.data, text.size);
+    }
+
+    // Finds the "headers\r\n\r\nbody" message at the front of a buffer that
+    // grows as data arrives, for the server, the CA and the clients alike.
+    // The search for the blank line resumes where the last call to parse()
+    // stopped, and once the headers are in, the body is only counted, so no
+    // byte is looked at twice. The message is received in place: the headers
+    // and the body are views into the buffer, and take() hands the buffer
+    // over instead of copying it.
+    class HttpParser {
+        // Content-Length is trusted for reserving memory only up to here, so
+        // a client that announces a large body and sends nothing holds no
+        // more than this. Past it the buffer grows as the body arrives, by
+        // doubling, like any std::string.
+        static const size_t reserve_limit = 1024 * 1024;
+
+        size_t max_body_size_;
+        std::string buffer_;
+        size_t scan_ = 0;
+        size_t body_start_ = std::string::npos;
+        size_t content_length_ = 0;
+
+        size_t find_content_length(size_t end_of_headers) const {
+            static const char name[] = "Content-Length";
+            const size_t name_size = sizeof(name) - 1;
+            size_t line_start = 0;
+            while (line_start < end_of_headers) {
+                size_t line_end = buffer_.find("\r\n", line_start);
+                if (line_end - line_start > name_size && buffer_[line_start + name_size] == ':'
+                    && buffer_.compare(line_start, name_size, name) == 0) {
+                    return strtoul(buffer_.c_str() + line_start + name_size + 1, nullptr, 10);
+                }
+                line_start = line_end + 2;
+            }
+            throw std::runtime_error("empty header or no content length.");
+        }
+
+    public:
+        // Messages with a longer body are refused.
+        explicit HttpParser(size_t max_body_size = SIZE_MAX) : max_body_size_(max_body_size) {}
+
+        // Raw data is appended here.
+        std::string& buffer() { return buffer_; }
+        const std::string& buffer() const { return buffer_; }
+
+        // The size of the whole message at the front of the buffer, or 0
+        // while it is incomplete. Throws if its headers have no Content-Length
+        // or it is too large.
+        size_t parse() {
+            if (body_start_ == std::string::npos) {
+                size_t end_of_headers = buffer_.find("\r\n\r\n", scan_ < 3 ? 0 : scan_ - 3);
+                if (end_of_headers == std::string::npos) {
+                    scan_ = buffer_.size();
+                    return 0;
+                }
+                body_start_ = end_of_headers + 4;
+                content_length_ = find_content_length(end_of_headers + 2);
+                if (content_length_ > max_body_size_ || content_length_ > buffer_.max_size() - body_start_) {
+                    throw std::runtime_error("content length too large.");
+                }
+                buffer_.reserve(body_start_ + (content_length_ < reserve_limit ? content_length_ : reserve_limit));
+            }
+            size_t total = body_start_ + content_length_;
+            return buffer_.size() < total ? 0 : total;
+        }
+
+        // How much of the body is still missing, once the headers are in.
+        size_t missing() const {
+            if (body_start_ == std::string::npos || buffer_.size() >= body_start_ + content_length_) {
+                return 0;
+            }
+            return body_start_ + content_length_ - buffer_.size();
+        }
+
+        // The header lines, each ending in "\r\n"; valid once parse() succeeded.
+        TextView headers() const { return TextView{buffer_.data(), body_start_ - 2}; }
+        TextView body() const { return TextView{buffer_.data() + body_start_, content_length_}; }
+
+        // Removes the parsed message from the front of the buffer and returns
+        // it; whatever follows it stays for the next parse().
+        std::string take() {
+            size_t total = body_start_ + content_length_;
+            std::string message;
+            if (buffer_.size() == total) {
+                message.swap(buffer_);
+            } else {
+                message.assign(buffer_, 0, total);
+                buffer_.erase(0, total);
+            }
+            scan_ = 0;
+            body_start_ = std::string::npos;
+            content_length_ = 0;
+            return message;
+        }
+    };
+
+    // The first byte in [p, end) that is one of the n (at most 4) bytes of
+    // set, or end. Requests are split on "\r\n", "&", "=" and " ", and the
+    // bodies can be megabytes of certificate or ciphertext, so the bytes are
+    // compared 32 at a time with AVX2 where the CPU has it, 16 at a time with
+    // SSE2 otherwise, and one at a time only on other machines and at the
+    // tail. A single byte is left to memchr, which glibc vectorizes as well.
+    // Each variant finishes its own tail: calling from AVX2 code into SSE2
+    // code costs a state transition that is slower than the whole search.
+    inline const char *find_any_scalar(const char *p, const char *end, const char *set, size_t n)
+    {
+        for (; p < end; p++) {
+            for (size_t i = 0; i < n; i++) {
+                if (*p == set[i]) {
+                    return p;
+                }
+            }
+        }
+        return end;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("sse2")))
+    const char *find_any_sse2(const char *p, const char *end, const char *set, size_t n)
+    {
+        __m128i needles[4];
+        for (size_t i = 0; i < n; i++) {
+            needles[i] = _mm_set1_epi8(set[i]);
+        }
+        for (; end - p >= 16; p += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            __m128i hits = _mm_cmpeq_epi8(chunk, needles[0]);
+            for (size_t i = 1; i < n; i++) {
+                hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, needles[i]));
+            }
+            if (int mask = _mm_movemask_epi8(hits)) {
+                return p + __builtin_ctz(mask);
+            }
+        }
+        return find_any_scalar(p, end, set, n);
+    }
+
+    __attribute__((target("avx2")))
+    const char *find_any_avx2(const char *p, const char *end, const char *set, size_t n)
+    {
+        __m256i needles[4];
+        for (size_t i = 0; i < n; i++) {
+            needles[i] = _mm256_set1_epi8(set[i]);
+        }
+        for (; end - p >= 32; p += 32) {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            __m256i hits = _mm256_cmpeq_epi8(chunk, needles[0]);
+            for (size_t i = 1; i < n; i++) {
+                hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(chunk, needles[i]));
+            }
+            if (unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hits))) {
+                return p + __builtin_ctz(mask);
+            }
+        }
+        return find_any_scalar(p, end, set, n);
+    }
+#endif
+
+    const char *find_any(const char *p, const char *end, const char *set, size_t n)
+    {
+        if (n > 4) {
+            throw std::invalid_argument("find_any: at most 4 bytes");
+        }
+        if (n == 1) {
+            const void *found = memchr(p, set[0], end - p);
+            return found == nullptr ? end : static_cast<const char*>(found);
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+        static const bool sse2 = __builtin_cpu_supports("sse2");
+        if (avx2) {
+            return find_any_avx2(p, end, set, n);
+        }
+        if (sse2) {
+            return find_any_sse2(p, end, set, n);
+        }
+#endif
+        return find_any_scalar(p, end, set, n);
+    }
+
+    // Splits text at every delimiter into views of it, like the old
+    // splitStringBy: n delimiters give n + 1 pieces, empty ones included.
+    // pieces, a vector of TextView with any allocator, is cleared first, so
+    // a caller can keep reusing its storage.
+    template<class Vector>
+    void split(TextView text, const char *delimiter, Vector& pieces)
+    {
+        size_t delimiter_size = strlen(delimiter);
+        const char *p = text.data;
+        const char *end = text.data + text.size;
+        const char *start = p;
+        pieces.clear();
+        while ((p = my::find_any(p, end, delimiter, 1)) != end) {
+            if (static_cast<size_t>(end - p) >= delimiter_size && memcmp(p, delimiter, delimiter_size) == 0) {
+                pieces.push_back(TextView(start, p - start));
+                p += delimiter_size;
+                start = p;
+            } else {
+                p++;
+            }
+        }
+        pieces.push_back(TextView(start, end - start));
+    }
+
+    std::vector<TextView> split(TextView text, const char *delimiter)
+    {
+        std::vector<TextView> pieces;
+        my::split(text, delimiter, pieces);
+        return pieces;
+    }
+
+    // The "name=value&name=value" parameters line of a request, as views
+    // into it. It is read in a single pass over the line and kept in place,
+    // so building it allocates nothing. As before, a value ends at the next
+    // "=" or "&", a later parameter wins over an earlier one of the same
+    // name, and a missing one reads as empty. Requests have a handful of
+    // parameters; any past max_params are ignored.
+    class FormParams {
+        static const size_t max_params = 16;
+
+        TextView names_[max_params];
+        TextView values_[max_params];
+        size_t size_ = 0;
+
+    public:
+        FormParams() {}
+
+        explicit FormParams(TextView line) {
+            const char *end = line.data + line.size;
+            const char *p = line.data;
+            while (p < end && size_ < max_params) {
+                const char *name_end = my::find_any(p, end, "&=", 2);
+                names_[size_] = TextView(p, name_end - p);
+                if (name_end < end && *name_end == '=') {
+                    const char *value = name_end + 1;
+                    const char *value_end = my::find_any(value, end, "&=", 2);
+                    values_[size_] = TextView(value, value_end - value);
+                    name_end = my::find_any(value_end, end, "&", 1);
+                }
+                size_++;
+                if (name_end == end) {
+                    break;
+                }
+                p = name_end + 1;
+            }
+        }
+
+        TextView operator[](const char *name) const {
+            for (size_t i = size_; i-- > 0; ) {
+                if (names_[i] == name) {
+                    return values_[i];
+                }
+            }
+            return TextView();
+        }
+    };
+
+    // Appends the status line and headers of a response whose body is
+    // content_length bytes to out, any std::basic_string; headers holds any
+    // extra "Name: value\r\n" lines.
+    template<class String>
+    void append_http_head(String& out, size_t content_length, int error_code = 200, TextView headers = TextView())
+    {
+        if (error_code == 200) {
+            out += "HTTP/1.1 200 OK\r\n";
+        }
+        else if (error_code == 403) {
+            out += "HTTP/1.1 403 Forbidden\r\n";
+        }
+        else if (error_code == 503) {
+            out += "HTTP/1.1 503 Service Unavailable\r\n";
+        }
+        else {
+            out += "HTTP/1.1 0 Unknown Error\r\n";
+        }
+        out.append(headers.data, headers.size);
+        char length[48];
+        out.append(length, snprintf(length, sizeof(length), "Content-Length: %zu\r\n\r\n", content_length));
+    }
+
+    // Appends what arrives next from bio to buffer, reading up to want bytes
+    // straight into it.
+    void receive_some_data(BIO *bio, std::string& buffer, size_t want = 16 * 1024)
+    {
+        size_t old_size = buffer.size();
+        buffer.resize(old_size + want);
+        int len;
+        while ((len = BIO_read(bio, &buffer[old_size], static_cast<int>(want))) <= 0) {
+            if (len == 0 && BIO_should_retry(bio)) {
+                continue;
+            }
+            buffer.resize(old_size);
+            my::print_errors_and_throw(len < 0 ? "error in BIO_read" : "empty BIO_read");
+        }
+        buffer.resize(old_size + len);
+    }
+
+    // Reads the rest of the message parser holds the start of, and returns it
+    // as "headers\r\n\r\nbody".
+    std::string receive_http_message(BIO *bio, HttpParser& parser)
+    {
+        size_t total;
+        while ((total = parser.parse()) == 0) {
+            size_t missing = parser.missing();
+            my::receive_some_data(bio, parser.buffer(), missing == 0 ? 16 * 1024 : std::min<size_t>(missing, 1024 * 1024));
+        }
+        if (parser.buffer().size() != total) {
+            my::print_errors_and_throw("content length does not match.");
+        }
+        return parser.take();
+    }
+
+    std::string receive_http_message(BIO *bio)
+    {
+        HttpParser parser;
+        return my::receive_http_message(bio, parser);
+    }
+
+} // namespace my
@@ -0,0 +1,366 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+
+namespace my {
+
+    enum LogLevel { LOG_TRACE, LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+    inline const char *log_level_name(LogLevel level)
+    {
+        static const char *names[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR"};
+        return names[level];
+    }
+
+    // Reads "trace", "debug", "info", "warn" or "error", as in log_level in config.
+    inline bool parse_log_level(const std::string& name, LogLevel& level)
+    {
+        static const char *names[] = {"trace", "debug", "info", "warn", "error"};
+        for (int i = LOG_TRACE; i <= LOG_ERROR; i++) {
+            if (name == names[i]) {
+                level = static_cast<LogLevel>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Log lines are formatted by the thread that logs them and handed to a
+    // background thread that writes them to stdout in batches, so a worker
+    // never waits for the terminal or the log file. The hand-over is a
+    // bounded lock-free ring of fixed-size slots (Vyukov's bounded queue):
+    // a producer claims a slot with one compare-and-swap, copies its line
+    // in, and publishes it by bumping the slot's sequence number. When the
+    // ring is full the line is dropped and counted rather than waited for.
+    // The logger is never destroyed, so threads still running at exit can
+    // keep calling it; what is in the ring is written out by an atexit
+    // handler. A forked child starts its own flusher, and the ring is
+    // emptied before the fork so no line comes out twice.
+    class Logger {
+    public:
+        static const size_t line_size = 512;
+
+    private:
+        static const size_t slot_count = 1024;  // a power of two
+
+        struct Slot {
+            std::atomic<size_t> sequence;
+            size_t size;
+            char text[line_size];
+        };
+
+        Slot slots_[slot_count];
+        std::atomic<size_t> tail_{0};     // next slot to claim
+        std::atomic<size_t> head_{0};     // next slot to write out; only the flusher moves it
+        std::atomic<size_t> dropped_{0};
+        std::atomic<int> level_{LOG_INFO};
+        std::atomic<bool> starting_{false};
+        std::atomic<bool> running_{false};
+        std::atomic<bool> stop_{false};
+        std::atomic<bool> closed_{false};
+        std::thread *flusher_ = nullptr;
+
+        Logger() {
+            for (size_t i = 0; i < slot_count; i++) {
+                slots_[i].sequence.store(i, std::memory_order_relaxed);
+            }
+            pthread_atfork([] { instance().flush(); }, nullptr, [] { instance().after_fork(); });
+            atexit([] { instance().close(); });
+        }
+
+        static void write_all(const char *data, size_t size) {
+            while (size > 0) {
+                ssize_t len = ::write(STDOUT_FILENO, data, size);
+                if (len <= 0) {
+                    return;
+                }
+                data += len;
+                size -= len;
+            }
+        }
+
+        // Writes out whatever has been published; only one thread at a time
+        // may do this. Returns whether there was anything.
+        bool drain(std::string& batch) {
+            batch.clear();
+            size_t head = head_.load(std::memory_order_relaxed);
+            while (true) {
+                Slot& slot = slots_[head & (slot_count - 1)];
+                if (slot.sequence.load(std::memory_order_acquire) != head + 1) {
+                    break;
+                }
+                batch.append(slot.text, slot.size);
+                slot.sequence.store(head + slot_count, std::memory_order_release);
+                head++;
+                head_.store(head, std::memory_order_release);
+            }
+            if (size_t dropped = dropped_.exchange(0, std::memory_order_relaxed)) {
+                batch += "WARN log ring full, lines dropped=" + std::to_string(dropped) + "\n";
+            }
+            write_all(batch.data(), batch.size());
+            return !batch.empty();
+        }
+
+        void start() {
+            bool expected = false;
+            if (starting_.compare_exchange_strong(expected, true)) {
+                flusher_ = new std::thread([this] {
+                    std::string batch;
+                    while (!stop_.load(std::memory_order_acquire)) {
+                        if (!drain(batch)) {
+                            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                        }
+                    }
+                });
+                running_.store(true, std::memory_order_release);
+            }
+        }
+
+        // The flusher did not survive the fork; its std::thread is left
+        // alone, since joining or destroying it here is not allowed.
+        void after_fork() {
+            flusher_ = nullptr;
+            running_.store(false);
+            starting_.store(false);
+        }
+
+        void close() {
+            if (closed_.exchange(true)) {
+                return;
+            }
+            stop_.store(true, std::memory_order_release);
+            if (flusher_ != nullptr) {
+                flusher_->join();
+            }
+            std::string batch;
+            drain(batch);
+        }
+
+    public:
+        Logger(const Logger&) = delete;
+        Logger& operator=(const Logger&) = delete;
+
+        static Logger& instance() {
+            static Logger *logger = new Logger;
+            return *logger;
+        }
+
+        LogLevel level() const { return static_cast<LogLevel>(level_.load(std::memory_order_relaxed)); }
+        void set_level(LogLevel level) { level_.store(level, std::memory_order_relaxed); }
+
+        // Queues one line, ending in "\n", of at most line_size bytes.
+        void push(const char *text, size_t size) {
+            if (closed_.load(std::memory_order_acquire)) {
+                write_all(text, size);
+                return;
+            }
+            if (!running_.load(std::memory_order_acquire)) {
+                start();
+            }
+            size_t tail = tail_.load(std::memory_order_relaxed);
+            Slot *slot;
+            while (true) {
+                slot = &slots_[tail & (slot_count - 1)];
+                size_t sequence = slot->sequence.load(std::memory_order_acquire);
+                if (sequence == tail) {
+                    if (tail_.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (sequence < tail) {
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                } else {
+                    tail = tail_.load(std::memory_order_relaxed);
+                }
+            }
+            slot->size = size;
+            memcpy(slot->text, text, size);
+            slot->sequence.store(tail + 1, std::memory_order_release);
+        }
+
+        // Waits until every line queued so far has been written out.
+        void flush() {
+            size_t tail = tail_.load(std::memory_order_acquire);
+            if (!running_.load(std::memory_order_acquire)) {
+                std::string batch;
+                drain(batch);
+                return;
+            }
+            while (head_.load(std::memory_order_acquire) < tail) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    };
+
+    inline bool log_enabled(LogLevel level)
+    {
+        return level >= Logger::instance().level();
+    }
+
+    inline void set_log_level(LogLevel level)
+    {
+        Logger::instance().set_level(level);
+    }
+
+    // One line of the log: "LEVEL message key=value ...". It is built with
+    // << for the message and field() for the structured part, in a buffer
+    // on the stack, and queued when the record goes out of scope. A line
+    // longer than Logger::line_size is cut short. Below the configured
+    // level nothing is formatted at all.
+    class LogRecord {
+        static const size_t payload_limit = 256;
+
+        char text_[Logger::line_size];
+        size_t size_ = 0;
+        bool active_;
+
+        void append(const char *data, size_t size) {
+            size = std::min(size, sizeof(text_) - 1 - size_);  // room for the "\n"
+            memcpy(text_ + size_, data, size);
+            size_ += size;
+        }
+
+        void append_number(long long n) {
+            char digits[24];
+            append(digits, snprintf(digits, sizeof(digits), "%lld", n));
+        }
+
+        void append_number(unsigned long long n) {
+            char digits[24];
+            append(digits, snprintf(digits, sizeof(digits), "%llu", n));
+        }
+
+        void append_number(double n) {
+            char digits[32];
+            append(digits, snprintf(digits, sizeof(digits), "%g", n));
+        }
+
+        template<class T>
+        void append_number(T n, typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type* = nullptr) {
+            append_number(static_cast<long long>(n));
+        }
+
+        template<class T>
+        void append_number(T n, typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value>::type* = nullptr) {
+            append_number(static_cast<unsigned long long>(n));
+        }
+
+    public:
+        explicit LogRecord(LogLevel level) : active_(log_enabled(level)) {
+            if (active_) {
+                *this << log_level_name(level) << ' ';
+            }
+        }
+
+        LogRecord(LogRecord&& other) : size_(other.size_), active_(other.active_) {
+            memcpy(text_, other.text_, size_);
+            other.active_ = false;
+        }
+
+        LogRecord(const LogRecord&) = delete;
+        LogRecord& operator=(const LogRecord&) = delete;
+
+        ~LogRecord() {
+            if (active_) {
+                text_[size_++] = '\n';
+                Logger::instance().push(text_, size_);
+            }
+        }
+
+        LogRecord& operator<<(TextView text) {
+            if (active_) {
+                append(text.data, text.size);
+            }
+            return *this;
+        }
+
+        LogRecord& operator<<(const char *text) { return *this << TextView(text); }
+        LogRecord& operator<<(const std::string& text) { return *this << TextView(text); }
+
+        LogRecord& operator<<(char c) {
+            if (active_) {
+                append(&c, 1);
+            }
+            return *this;
+        }
+
+        template<class T>
+        typename std::enable_if<std::is_arithmetic<T>::value, LogRecord&>::type operator<<(T n) {
+            if (active_) {
+                append_number(n);
+            }
+            return *this;
+        }
+
+        // Appends " name=value"; value is quoted if it is empty or has a space.
+        template<class T>
+        LogRecord& field(const char *name, const T& value) {
+            if (active_) {
+                separate();
+                *this << name << '=';
+                append_value(value);
+            }
+            return *this;
+        }
+
+        // Appends " name=" and the first payload_limit bytes of data, with
+        // anything unprintable shown as '.', and its full size. For request
+        // bodies, certificates and ciphertext, at trace level.
+        LogRecord& payload(const char *name, TextView data) {
+            if (active_) {
+                separate();
+                *this << name << '=';
+                char shown[payload_limit];
+                size_t n = data.size < payload_limit ? data.size : payload_limit;
+                for (size_t i = 0; i < n; i++) {
+                    unsigned char c = data.data[i];
+                    shown[i] = c >= 0x20 && c < 0x7f ? c : '.';
+                }
+                append(shown, n);
+                *this << (n < data.size ? "..." : "") << " (" << data.size << " bytes)";
+            }
+            return *this;
+        }
+
+    private:
+        void separate() {
+            if (text_[size_ - 1] != ' ') {
+                *this << ' ';
+            }
+        }
+
+        void append_value(TextView value) {
+            bool quote = value.empty() || memchr(value.data, ' ', value.size) != nullptr;
+            if (quote) {
+                *this << '"';
+            }
+            *this << value;
+            if (quote) {
+                *this << '"';
+            }
+        }
+
+        void append_value(const char *value) { append_value(TextView(value)); }
+        void append_value(const std::string& value) { append_value(TextView(value)); }
+
+        template<class T>
+        void append_value(T n, typename std::enable_if<std::is_arithmetic<T>::value>::type* = nullptr) {
+            *this << n;
+        }
+    };
+
+    inline LogRecord log(LogLevel level)
+    {
+        return LogRecord(level);
+    }
+
+} // namespace my
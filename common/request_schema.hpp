@@ -0,0 +1,193 @@
+#include <stddef.h>
+#include <stdint.h>
+
+namespace my {
+
+    // The first request of every conversation names its type in the "type"
+    // parameter. The mail server and the CA turn it into a RequestType with
+    // one hash and one comparison, then read the other parameters into the
+    // struct for that type below instead of looking them up as they go.
+    enum class RequestType {
+        UNKNOWN,
+        GETCERT,
+        CHANGEPW,
+        SENDMSG,
+        RECVMSG,
+        PEERCERT,
+        PEERPUTCERT,
+        PEERDELIVER
+    };
+
+    // FNV-1a, usable in constant expressions so type names can be case labels.
+    constexpr uint32_t request_hash(const char *s, size_t n)
+    {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < n; i++) {
+            h = (h ^ static_cast<unsigned char>(s[i])) * 16777619u;
+        }
+        return h;
+    }
+
+    constexpr uint32_t request_hash(const char *s)
+    {
+        size_t n = 0;
+        while (s[n] != '\0') {
+            n++;
+        }
+        return request_hash(s, n);
+    }
+
+    inline const char *request_name(RequestType type)
+    {
+        switch (type) {
+        case RequestType::GETCERT: return "getcert";
+        case RequestType::CHANGEPW: return "changepw";
+        case RequestType::SENDMSG: return "sendmsg";
+        case RequestType::RECVMSG: return "recvmsg";
+        case RequestType::PEERCERT: return "peercert";
+        case RequestType::PEERPUTCERT: return "peerputcert";
+        case RequestType::PEERDELIVER: return "peerdeliver";
+        default: return "";
+        }
+    }
+
+    // The hash is perfect over the type names: two that collided would be
+    // duplicate case labels, which do not compile. Any other text that
+    // happens to hash like a name is caught by the comparison.
+    inline RequestType request_type_of(TextView name)
+    {
+        RequestType type;
+        switch (request_hash(name.data, name.size)) {
+        case request_hash("getcert"): type = RequestType::GETCERT; break;
+        case request_hash("changepw"): type = RequestType::CHANGEPW; break;
+        case request_hash("sendmsg"): type = RequestType::SENDMSG; break;
+        case request_hash("recvmsg"): type = RequestType::RECVMSG; break;
+        case request_hash("peercert"): type = RequestType::PEERCERT; break;
+        case request_hash("peerputcert"): type = RequestType::PEERPUTCERT; break;
+        case request_hash("peerdeliver"): type = RequestType::PEERDELIVER; break;
+        default: return RequestType::UNKNOWN;
+        }
+        return name == request_name(type) ? type : RequestType::UNKNOWN;
+    }
+
+    // Requests from the other shards of a cluster, all authenticated by the
+    // cluster secret.
+    inline bool is_peer_request(RequestType type)
+    {
+        return type == RequestType::PEERCERT || type == RequestType::PEERPUTCERT || type == RequestType::PEERDELIVER;
+    }
+
+    enum FieldUse { REQUIRED, OPTIONAL };
+
+    // One struct per request type. fields() lists its parameters for
+    // parse_request(), which is instantiated for each struct, so reading a
+    // request is a fixed sequence of lookups known at compile time. valid()
+    // checks what depends on more than one field. The views point into the
+    // request, which has to outlive the struct.
+
+    // getcert: the CSR follows the parameters line.
+    struct GetCertRequest {
+        TextView username;
+        TextView password;
+
+        template<class F>
+        void fields(F&& field) {
+            field("username", username, REQUIRED);
+            field("password", password, REQUIRED);
+        }
+        bool valid() const { return true; }
+    };
+
+    // changepw: the CSR for the new certificate follows the parameters line.
+    struct ChangePwRequest {
+        TextView username;
+        TextView old_password;
+        TextView new_password;
+
+        template<class F>
+        void fields(F&& field) {
+            field("username", username, REQUIRED);
+            field("old_password", old_password, REQUIRED);
+            field("new_password", new_password, REQUIRED);
+        }
+        bool valid() const { return true; }
+    };
+
+    // sendmsg and recvmsg: without auth the client takes the challenge with
+    // the certificate that follows the parameters line; with auth=tls or
+    // auth=token it has already proved who it is.
+    struct SendMsgRequest {
+        TextView auth;
+        TextView token;
+
+        template<class F>
+        void fields(F&& field) {
+            field("auth", auth, OPTIONAL);
+            field("token", token, OPTIONAL);
+        }
+        bool valid() const { return auth.empty() || auth == "tls" || auth == "token"; }
+    };
+
+    struct RecvMsgRequest {
+        TextView auth;
+        TextView token;
+        TextView wait;  // seconds to wait for mail, if the mailbox is empty
+
+        template<class F>
+        void fields(F&& field) {
+            field("auth", auth, OPTIONAL);
+            field("token", token, OPTIONAL);
+            field("wait", wait, OPTIONAL);
+        }
+        bool valid() const { return auth.empty() || auth == "tls" || auth == "token"; }
+    };
+
+    // peercert and peerputcert; a certificate to take over follows the
+    // parameters line of a peerputcert.
+    struct PeerCertRequest {
+        TextView username;
+        TextView secret;
+
+        template<class F>
+        void fields(F&& field) {
+            field("username", username, REQUIRED);
+            field("secret", secret, REQUIRED);
+        }
+        bool valid() const { return true; }
+    };
+
+    // peerdeliver: the three parts of the message follow the parameters
+    // line back to back, and their sizes are parameters.
+    struct PeerDeliverRequest {
+        TextView username;
+        TextView secret;
+        TextView part_sizes[3];  // key.bin.enc, id_mail.enc, signature.sign
+
+        template<class F>
+        void fields(F&& field) {
+            field("username", username, REQUIRED);
+            field("secret", secret, REQUIRED);
+            field("key.bin.enc", part_sizes[0], REQUIRED);
+            field("id_mail.enc", part_sizes[1], REQUIRED);
+            field("signature.sign", part_sizes[2], REQUIRED);
+        }
+        bool valid() const { return true; }
+    };
+
+    // Reads request from the parameters line. Returns false if a required
+    // field is missing or empty or the request is not valid(); the client
+    // is then refused before anything is done for it.
+    template<class Request>
+    bool parse_request(const FormParams& params, Request& request)
+    {
+        bool complete = true;
+        request.fields([&](const char *name, TextView& value, FieldUse use) {
+            value = params[name];
+            if (use == REQUIRED && value.empty()) {
+                complete = false;
+            }
+        });
+        return complete && request.valid();
+    }
+
+} // namespace my
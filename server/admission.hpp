@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <mutex>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <unordered_map>
+
+namespace my {
+
+    // The address a connection comes from, without the port.
+    std::string peer_address(int fd)
+    {
+        struct sockaddr_storage addr = {};
+        socklen_t addr_len = sizeof(addr);
+        char host[INET6_ADDRSTRLEN] = "";
+        if (getpeername(fd, reinterpret_cast<struct sockaddr*>(&addr), &addr_len) == 0) {
+            if (addr.ss_family == AF_INET6) {
+                inet_ntop(AF_INET6, &reinterpret_cast<struct sockaddr_in6*>(&addr)->sin6_addr, host, sizeof(host));
+            } else if (addr.ss_family == AF_INET) {
+                inet_ntop(AF_INET, &reinterpret_cast<struct sockaddr_in*>(&addr)->sin_addr, host, sizeof(host));
+            }
+        }
+        return host;
+    }
+
+    // Token buckets keyed by a user or source address: each key may start
+    // `rate` conversations per second, with bursts of up to `burst`. A rate
+    // of 0 turns the limit off.
+    class RateLimiter {
+        typedef std::chrono::steady_clock Clock;
+
+        struct Bucket {
+            double tokens;
+            Clock::time_point updated;
+        };
+
+        double rate_;
+        double burst_;
+        std::mutex mutex_;
+        std::unordered_map<std::string, Bucket> buckets_;
+
+        double refill(Bucket& bucket, Clock::time_point now) const {
+            double elapsed = std::chrono::duration<double>(now - bucket.updated).count();
+            bucket.updated = now;
+            bucket.tokens = std::min(burst_, bucket.tokens + elapsed * rate_);
+            return bucket.tokens;
+        }
+
+    public:
+        RateLimiter(const RateLimiter&) = delete;
+        RateLimiter& operator=(const RateLimiter&) = delete;
+
+        explicit RateLimiter(double rate, double burst) : rate_(rate), burst_(std::max(burst, 1.0)) {}
+
+        bool allow(const std::string& key) {
+            if (rate_ <= 0) {
+                return true;
+            }
+            Clock::time_point now = Clock::now();
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (buckets_.size() > 4096) {
+                // A bucket that has filled up again is the same as a new one.
+                for (auto it = buckets_.begin(); it != buckets_.end(); ) {
+                    it = refill(it->second, now) >= burst_ ? buckets_.erase(it) : std::next(it);
+                }
+            }
+            auto inserted = buckets_.emplace(key, Bucket{burst_, now});
+            Bucket& bucket = inserted.first->second;
+            if (refill(bucket, now) < 1) {
+                return false;
+            }
+            bucket.tokens -= 1;
+            return true;
+        }
+
+        // Gives back the token allow() just took for key.
+        void refund(const std::string& key) {
+            if (rate_ <= 0) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = buckets_.find(key);
+            if (it != buckets_.end()) {
+                it->second.tokens = std::min(burst_, it->second.tokens + 1);
+            }
+        }
+    };
+
+    // Decides, from the first request alone, whether a conversation may go
+    // ahead: its source and its user must each have a token left, and fewer
+    // than max_in_flight admitted conversations may be running. Whatever is
+    // turned away gets a busy response before any verification, challenge or
+    // disk work is done for it, and a refusal by the user's bucket gives
+    // the source its token back. Only a user proved by a TLS client
+    // certificate has one bucket wherever it connects from; a name that is
+    // merely claimed is counted per source, so a client cannot spend
+    // another user's allowance from its own address.
+    class AdmissionControl {
+        size_t max_in_flight_;
+        std::atomic<size_t> in_flight_{0};
+        RateLimiter sources_;
+        RateLimiter users_;
+
+    public:
+        AdmissionControl(const AdmissionControl&) = delete;
+        AdmissionControl& operator=(const AdmissionControl&) = delete;
+
+        explicit AdmissionControl(size_t max_in_flight, double source_rate, double source_burst,
+                                  double user_rate, double user_burst)
+            : max_in_flight_(max_in_flight), sources_(source_rate, source_burst), users_(user_rate, user_burst) {}
+
+        // On success the caller holds one in-flight slot until leave().
+        bool enter(const std::string& source, const std::string& user, bool authenticated) {
+            if (max_in_flight_ > 0 && ++in_flight_ > max_in_flight_) {
+                in_flight_--;
+                return false;
+            }
+            if (!sources_.allow(source)) {
+                leave();
+                return false;
+            }
+            if (!users_.allow(authenticated ? user : user + "@" + source)) {
+                sources_.refund(source);
+                leave();
+                return false;
+            }
+            return true;
+        }
+
+        void leave() {
+            if (max_in_flight_ > 0) {
+                in_flight_--;
+            }
+        }
+    };
+
+} // namespace my
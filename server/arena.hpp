@@ -0,0 +1,152 @@
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace my {
+
+    // A monotonic allocator for what one connection builds while it handles
+    // a request: response heads, lists of recipients, certificate replies.
+    // Allocations are carved out of the block in front, which starts as
+    // inline_size bytes inside the arena itself and is chained to a heap
+    // block when it runs out; nothing is freed one by one. release() drops
+    // everything at once and starts over in the inline block, keeping a few
+    // heap blocks for the next request, so a connection settles into making
+    // no call to malloc at all.
+    class Arena {
+        static const size_t inline_size = 4096;
+        static const size_t block_size = 16 * 1024;
+        static const size_t max_spares = 4;
+
+        struct Block {
+            Block *next;
+            size_t size;
+        };
+
+        alignas(alignof(max_align_t)) char inline_[inline_size];
+        char *next_ = inline_;
+        char *end_ = inline_ + inline_size;
+        Block *blocks_ = nullptr;  // heap blocks in use, newest first
+        Block *spares_ = nullptr;  // kept by release() for the next request
+        size_t spare_count_ = 0;
+        size_t block_count_ = 0;
+
+        static char *align_up(char *p, size_t align) {
+            return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + align - 1) & ~(uintptr_t)(align - 1));
+        }
+
+        char *new_block(size_t size) {
+            Block *block = spares_;
+            if (size == block_size && block != nullptr) {
+                spares_ = block->next;
+                spare_count_--;
+            } else {
+                block = static_cast<Block*>(malloc(sizeof(Block) + size));
+                if (block == nullptr) {
+                    throw std::bad_alloc();
+                }
+                block->size = size;
+                block_count_++;
+            }
+            block->next = blocks_;
+            blocks_ = block;
+            return reinterpret_cast<char*>(block) + sizeof(Block);
+        }
+
+    public:
+        Arena() {}
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+        ~Arena() {
+            release();
+            while (spares_ != nullptr) {
+                Block *next = spares_->next;
+                free(spares_);
+                spares_ = next;
+            }
+        }
+
+        void *allocate(size_t size, size_t align) {
+            char *p = align_up(next_, align);
+            if (size <= static_cast<size_t>(end_ - p)) {
+                next_ = p + size;
+                return p;
+            }
+            if (size + align > block_size) {
+                // A piece larger than a block gets one of its own, and what
+                // is left of the one in front stays in use.
+                return align_up(new_block(size + align), align);
+            }
+            next_ = new_block(block_size);
+            end_ = next_ + block_size;
+            p = align_up(next_, align);
+            next_ = p + size;
+            return p;
+        }
+
+        // Frees every block at once but the spares. Whatever was allocated is
+        // gone, so no container using the arena may be touched afterwards.
+        void release() {
+            while (blocks_ != nullptr) {
+                Block *next = blocks_->next;
+                if (spare_count_ < max_spares && blocks_->size == block_size) {
+                    blocks_->next = spares_;
+                    spares_ = blocks_;
+                    spare_count_++;
+                } else {
+                    free(blocks_);
+                }
+                blocks_ = next;
+            }
+            next_ = inline_;
+            end_ = inline_ + inline_size;
+        }
+
+        // How many heap blocks the arena has asked malloc for since it was made.
+        size_t block_count() const { return block_count_; }
+    };
+
+    // Lets standard containers allocate from an Arena; deallocation is left
+    // to Arena::release(). Without an arena it is the plain allocator, so
+    // the same types work where there is no connection to charge.
+    template<class T>
+    class ArenaAllocator {
+    public:
+        typedef T value_type;
+        typedef std::true_type propagate_on_container_move_assignment;
+        typedef std::true_type propagate_on_container_swap;
+
+        Arena *arena;
+
+        ArenaAllocator(Arena *arena = nullptr) noexcept : arena(arena) {}
+        template<class U>
+        ArenaAllocator(const ArenaAllocator<U>& other) noexcept : arena(other.arena) {}
+
+        T *allocate(size_t n) {
+            if (arena == nullptr) {
+                return static_cast<T*>(::operator new(n * sizeof(T)));
+            }
+            return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+        }
+
+        void deallocate(T *p, size_t) noexcept {
+            if (arena == nullptr) {
+                ::operator delete(p);
+            }
+        }
+    };
+
+    template<class T, class U>
+    bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena == b.arena; }
+    template<class T, class U>
+    bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena != b.arena; }
+
+    typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>> ArenaString;
+
+    template<class T>
+    using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+} // namespace my
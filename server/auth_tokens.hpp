@@ -0,0 +1,92 @@
+#include <chrono>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+namespace my {
+
+    // Proof that a client passed the identity challenge recently, so its next
+    // sendmsg or recvmsg can skip it. A token reads "user:expiry:mac", where
+    // mac is an HMAC-SHA256 over the user, the fingerprint of the certificate
+    // the user had on file when the token was issued, and the expiry time.
+    // Like the session ticket keys, the MAC key is random and lives only in
+    // memory: a restart, a new certificate or the expiry time makes the
+    // client go through the challenge again.
+    class AuthTokens {
+        unsigned char key_[32];
+        uint64_t lifetime_;
+
+        static uint64_t now() {
+            auto now = std::chrono::system_clock::now().time_since_epoch();
+            return std::chrono::duration_cast<std::chrono::seconds>(now).count();
+        }
+
+        std::string mac(const std::string& user, const std::string& fingerprint, const std::string& expiry) const {
+            std::string input = user + '\0' + fingerprint + '\0' + expiry;
+            unsigned char md[EVP_MAX_MD_SIZE];
+            unsigned int md_len = 0;
+            HMAC(EVP_sha256(), key_, sizeof(key_), reinterpret_cast<const unsigned char*>(input.data()), input.size(),
+                 md, &md_len);
+            static const char hex[] = "0123456789abcdef";
+            std::string out;
+            for (unsigned int i = 0; i < md_len; i++) {
+                out += hex[md[i] >> 4];
+                out += hex[md[i] & 0xf];
+            }
+            return out;
+        }
+
+    public:
+        AuthTokens(const AuthTokens&) = delete;
+        AuthTokens& operator=(const AuthTokens&) = delete;
+
+        // A lifetime of 0 turns tokens off.
+        explicit AuthTokens(uint64_t lifetime) : lifetime_(lifetime) {
+            if (RAND_bytes(key_, sizeof(key_)) != 1) {
+                throw std::runtime_error("AuthTokens: error in RAND_bytes");
+            }
+        }
+        ~AuthTokens() {
+            OPENSSL_cleanse(key_, sizeof(key_));
+        }
+
+        bool enabled() const { return lifetime_ > 0; }
+
+        std::string issue(const std::string& user, const std::string& fingerprint) const {
+            std::string expiry = std::to_string(now() + lifetime_);
+            return user + ":" + expiry + ":" + mac(user, fingerprint, expiry);
+        }
+
+        // The user a token claims to be for; whether it really is, is up to valid().
+        static std::string user_of(const std::string& token) {
+            size_t mac_start = token.rfind(':');
+            size_t expiry_start = mac_start == std::string::npos || mac_start == 0 ? std::string::npos
+                                                                                     : token.rfind(':', mac_start - 1);
+            return expiry_start == std::string::npos ? "" : token.substr(0, expiry_start);
+        }
+
+        // Whether token was issued by this server, has not expired, and was
+        // issued while the user had the certificate with this fingerprint.
+        bool valid(const std::string& token, const std::string& fingerprint) const {
+            std::string user = user_of(token);
+            if (!enabled() || user.empty()) {
+                return false;
+            }
+            size_t mac_start = token.rfind(':');
+            std::string expiry = token.substr(user.size() + 1, mac_start - user.size() - 1);
+            if (expiry.empty() || expiry.size() > 19 || expiry.find_first_not_of("0123456789") != std::string::npos
+                || std::stoull(expiry) < now()) {
+                return false;
+            }
+            std::string expected = mac(user, fingerprint, expiry);
+            return token.size() - mac_start - 1 == expected.size()
+                && CRYPTO_memcmp(token.data() + mac_start + 1, expected.data(), expected.size()) == 0;
+        }
+    };
+
+} // namespace my
@@ -0,0 +1,174 @@
+// Counts the heap allocations made while handling the first request of a
+// sendmsg conversation and answering it, the way Session did it before the
+// connection arena and the way it does now. Build and run with `make bench`.
+#include <chrono>
+#include <map>
+#include <new>
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "../common/http_parser.hpp"
+#include "arena.hpp"
+
+namespace my {
+
+[[noreturn]] void print_errors_and_throw(const char *message)
+{
+    throw std::runtime_error(message);
+}
+
+} // namespace my
+
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+    allocations++;
+    if (void *p = malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+// The old tokenizer, as it was in server.cpp.
+std::vector<std::string> splitStringBy(std::string s, std::string delimiter) {
+    std::vector<std::string> splitted;
+    std::string unparsed(s);
+    size_t pos = 0;
+    std::string token;
+    while ((pos = unparsed.find(delimiter)) != std::string::npos) {
+        token = unparsed.substr(0, pos);
+        splitted.push_back(token);
+        unparsed.erase(0, pos + delimiter.length());
+    }
+    splitted.push_back(unparsed);
+    return splitted;
+}
+
+// A stand-in for certs/<name>.cert.pem: a PEM certificate is about 2 KB.
+const std::string& certificate_of(const std::string& /*name*/)
+{
+    static const std::string cert = "-----BEGIN CERTIFICATE-----\n" + std::string(1900, 'A') + "\n-----END CERTIFICATE-----\n";
+    return cert;
+}
+
+const std::string token_header = "Token: overrich:1700000000:0123456789abcdef0123456789abcdef\r\n";
+
+// As Session handled it with std::string, std::map and std::vector throughout.
+size_t handle_before(const std::string& request, std::vector<std::string>& output)
+{
+    std::vector<std::string> requestLines = splitStringBy(request, "\r\n");
+    std::map<std::string, std::string> paramMap;
+    for (const std::string& param : splitStringBy(requestLines[5], "&")) {
+        std::vector<std::string> kv = splitStringBy(param, "=");
+        paramMap[kv[0]] = kv.size() > 1 ? kv[1] : "";
+    }
+    std::vector<std::string> recipients;
+    for (const std::string& name : splitStringBy(requestLines[6], " ")) {
+        if (!name.empty()) {
+            recipients.push_back(name);
+        }
+    }
+    std::vector<std::string> certificates;
+    for (const std::string& name : recipients) {
+        certificates.push_back(certificate_of(name));
+    }
+    std::string certResponse;
+    for (size_t i = 0; i < recipients.size(); i++) {
+        certResponse += recipients[i] + "\r\n";
+        certResponse += certificates[i] + "\r\n";
+    }
+    std::string response;
+    response.reserve(64 + token_header.size() + certResponse.size());
+    my::append_http_head(response, certResponse.size(), 200, token_header);
+    response += certResponse;
+    output.push_back(std::move(response));
+    return paramMap["token"].size();
+}
+
+// As Session handles it now: views into the request, a FormParams, and the
+// lists and the response built in the connection's arena.
+size_t handle_after(const std::string& request, std::vector<my::TextView>& requestLines, my::Arena& arena,
+                    std::vector<my::ArenaString>& output)
+{
+    arena.release();
+    my::split(request, "\r\n", requestLines);
+    my::FormParams paramMap(requestLines[5]);
+    my::ArenaVector<my::TextView> names{my::ArenaAllocator<my::TextView>(&arena)};
+    my::split(requestLines[6], " ", names);
+    my::ArenaVector<my::TextView> recipients{my::ArenaAllocator<my::TextView>(&arena)};
+    for (my::TextView name : names) {
+        if (!name.empty()) {
+            recipients.push_back(name);
+        }
+    }
+    my::ArenaString certResponse{my::ArenaAllocator<char>(&arena)};
+    for (my::TextView recipient : recipients) {
+        certResponse.append(recipient.data, recipient.size);
+        certResponse += "\r\n";
+        const std::string& cert = certificate_of(recipient.str());
+        certResponse.append(cert.data(), cert.size());
+        certResponse += "\r\n";
+    }
+    my::ArenaString response{my::ArenaAllocator<char>(&arena)};
+    response.reserve(64 + token_header.size() + certResponse.size());
+    my::append_http_head(response, certResponse.size(), 200, token_header);
+    response.append(certResponse.data(), certResponse.size());
+    output.push_back(std::move(response));
+    return paramMap["token"].size;
+}
+
+// Calls f requests times and prints the allocations and microseconds per call.
+template<class F>
+void measure(const char *name, int requests, F f)
+{
+    typedef std::chrono::steady_clock Clock;
+    size_t before = allocations;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < requests; i++) {
+        f();
+    }
+    double us = std::chrono::duration<double, std::micro>(Clock::now() - start).count() / requests;
+    printf("%-36s %14.1f %12.2f us\n", name, static_cast<double>(allocations - before) / requests, us);
+}
+
+int main()
+{
+    std::string body = "type=sendmsg&auth=token&token=overrich:1700000000:0123456789abcdef0123456789abcdef\r\n"
+                       "addleness unrosed muermo";
+    std::string request = "POST / HTTP/1.1\r\nHost: duckduckgo.com\r\nContent-Type: application/x-www-form-urlencoded\r\n"
+                          "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+    const int requests = 100000;
+    size_t found = 0;
+
+    printf("%-36s %14s %15s\n", "sendmsg first request", "allocations", "time");
+    measure("before: std::string, map, vector", requests, [&] {
+        std::vector<std::string> output;
+        found += handle_before(request, output);
+    });
+
+    // What a Session keeps across the requests of its connection; the
+    // output vector is handed to the front end with every request, so it
+    // is new each time in both cases.
+    my::Arena arena;
+    std::vector<my::TextView> requestLines;
+    measure("after: views and connection arena", requests, [&] {
+        std::vector<my::ArenaString> output;
+        found += handle_after(request, requestLines, arena, output);
+    });
+    printf("arena heap blocks over %d requests: %zu\n", requests, arena.block_count());
+    return found == 0;
+}
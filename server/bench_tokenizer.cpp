@@ -0,0 +1,123 @@
+// Times my::split and my::FormParams against the splitStringBy they
+// replaced, on request bodies of a few megabytes. Build and run with
+// `make bench`.
+#include <chrono>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "../common/http_parser.hpp"
+
+namespace my {
+
+[[noreturn]] void print_errors_and_throw(const char *message)
+{
+    throw std::runtime_error(message);
+}
+
+} // namespace my
+
+// The old tokenizer, as it was in server.cpp, CAserver.cpp and sendmsg.cpp.
+std::vector<std::string> splitStringBy(std::string s, std::string delimiter) {
+    std::vector<std::string> splitted;
+    std::string unparsed(s);
+    size_t pos = 0;
+    std::string token;
+    while ((pos = unparsed.find(delimiter)) != std::string::npos) {
+        token = unparsed.substr(0, pos);
+        splitted.push_back(token);
+        unparsed.erase(0, pos + delimiter.length());
+    }
+    splitted.push_back(unparsed);
+    return splitted;
+}
+
+// Milliseconds per call of f, over as many calls as fit in about half a second.
+template<class F>
+double time_ms(F f)
+{
+    typedef std::chrono::steady_clock Clock;
+    int calls = 0;
+    Clock::time_point start = Clock::now();
+    Clock::duration elapsed;
+    do {
+        f();
+        calls++;
+        elapsed = Clock::now() - start;
+    } while (elapsed < std::chrono::milliseconds(500));
+    return std::chrono::duration<double, std::milli>(elapsed).count() / calls;
+}
+
+// A sendmsg-like request: headers, a parameters line, then body_size bytes
+// of body. A binary body has a "\r\n" every 64K bytes or so; a text one has
+// one every line_size bytes, like a PEM certificate.
+std::string make_request(size_t body_size, size_t line_size)
+{
+    std::mt19937 rng(4181);
+    std::string request = "POST / HTTP/1.1\r\nHost: duckduckgo.com\r\nContent-Type: application/octet-stream\r\n"
+                          "Content-Length: " + std::to_string(body_size) + "\r\n\r\n"
+                          "type=sendmsg&auth=token&token=overrich:1700000000:0123456789abcdef&wait=30\r\n";
+    for (size_t i = 0; i < body_size; i++) {
+        if (line_size != 0 && i % line_size == line_size - 2) {
+            request += "\r\n";
+            i++;
+        } else {
+            request += static_cast<char>(line_size == 0 ? rng() : 'A' + rng() % 26);
+        }
+    }
+    return request;
+}
+
+int main()
+{
+    struct Case {
+        const char *name;
+        size_t body_size;
+        size_t line_size;
+    } cases[] = {
+        {"1 MB binary", 1 << 20, 0},
+        {"4 MB binary", 4 << 20, 0},
+        {"16 MB binary", 16 << 20, 0},
+        {"256 KB text, 64 byte lines", 256 << 10, 64},
+        {"1 MB text, 1 KB lines", 1 << 20, 1024},
+    };
+    printf("%-28s %14s %14s %9s\n", "body", "splitStringBy", "my::split", "speedup");
+    for (const Case& c : cases) {
+        std::string request = make_request(c.body_size, c.line_size);
+        size_t pieces = 0;
+        double old_ms = time_ms([&] { pieces += splitStringBy(request, "\r\n").size(); });
+        std::vector<my::TextView> lines;
+        double new_ms = time_ms([&] {
+            my::split(request, "\r\n", lines);
+            pieces += lines.size();
+        });
+        printf("%-28s %11.3f ms %11.3f ms %8.1fx\n", c.name, old_ms, new_ms, old_ms / new_ms);
+        if (pieces == 0) {
+            return 1;
+        }
+    }
+
+    std::string params = "type=sendmsg&auth=token&token=overrich:1700000000:0123456789abcdef&wait=30";
+    size_t found = 0;
+    double old_ms = time_ms([&] {
+        for (int i = 0; i < 1000; i++) {
+            std::map<std::string, std::string> paramMap;
+            for (const std::string& param : splitStringBy(params, "&")) {
+                std::vector<std::string> kv = splitStringBy(param, "=");
+                paramMap[kv[0]] = kv.size() > 1 ? kv[1] : "";
+            }
+            found += paramMap["token"].size();
+        }
+    });
+    double new_ms = time_ms([&] {
+        for (int i = 0; i < 1000; i++) {
+            my::FormParams paramMap(params);
+            found += paramMap["token"].size;
+        }
+    });
+    printf("%-28s %11.3f us %11.3f us %8.1fx\n", "parameters line", old_ms, new_ms, old_ms / new_ms);
+    return found == 0;
+}
@@ -0,0 +1,270 @@
+#include <algorithm>
+#include <atomic>
+#include <dirent.h>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+namespace my {
+
+    // Whether name can be a user name. Names end up in paths under certs/,
+    // messages/ and tmp/, so one has to stay a single path component.
+    inline bool valid_username(const std::string& name)
+    {
+        if (name.empty() || name[0] == '.' || name.find("..") != std::string::npos) {
+            return false;
+        }
+        for (char c : name) {
+            if (c == '/' || static_cast<unsigned char>(c) <= ' ' || c == 0x7f) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // A certificate as the server hands it out: the PEM text sent to
+    // clients, its DER encoding, its SHA-256 fingerprint and the parsed
+    // X509. It is never changed once made, so every connection can share
+    // the one in the CertStore. x509(), der() and fingerprint() are empty if
+    // the PEM does not parse.
+    class StoredCertificate {
+        X509 *x509_ = nullptr;
+        std::string pem_;
+        std::string der_;
+        std::string fingerprint_;
+
+    public:
+        StoredCertificate(const StoredCertificate&) = delete;
+        StoredCertificate& operator=(const StoredCertificate&) = delete;
+
+        explicit StoredCertificate(std::string pem) : pem_(std::move(pem)) {
+            BIO *bio = BIO_new_mem_buf(pem_.data(), pem_.size());
+            x509_ = bio == nullptr ? nullptr : PEM_read_bio_X509(bio, nullptr, nullptr, nullptr);
+            BIO_free(bio);
+            if (x509_ != nullptr) {
+                // Fills in what X509_cmp() would otherwise work out, and
+                // lock, on first use by several threads at once.
+                X509_check_purpose(x509_, -1, 0);
+                unsigned char *der = nullptr;
+                int len = i2d_X509(x509_, &der);
+                if (len > 0) {
+                    der_.assign(reinterpret_cast<char*>(der), len);
+                    OPENSSL_free(der);
+                }
+                fingerprint_ = CertVerifier::fingerprint(x509_);
+            }
+            ERR_clear_error();
+        }
+
+        ~StoredCertificate() { X509_free(x509_); }
+
+        X509 *x509() const { return x509_; }
+        const std::string& pem() const { return pem_; }
+        const std::string& der() const { return der_; }
+        const std::string& fingerprint() const { return fingerprint_; }
+    };
+
+    typedef std::shared_ptr<const StoredCertificate> CertificateRef;
+
+    // The certificates in certs/ by user, so that handing out a recipient's
+    // certificate, checking one presented for a challenge or a token, and
+    // encrypting challenges ahead of time are lookups instead of opening its
+    // file. preload() reads
+    // the directory with several threads at startup; a user missing after
+    // that is read when first asked for. An inotify watch on certs/ drops a
+    // user's entry once its file is replaced or removed, whether by this
+    // process, another worker process or a rebalance, and put() lets the
+    // handlers that install a certificate update it right away. A lookup
+    // that reads a file keeps what it read only if nothing in certs/
+    // changed meanwhile. Without inotify every lookup reads the file.
+    class CertStore {
+        std::mutex mutex_;
+        std::unordered_map<std::string, CertificateRef> certs_;
+        uint64_t version_ = 0;  // bumped by every change to certs/
+        int inotify_fd_;
+        int wake_fd_;
+        std::atomic<bool> stopping_{false};
+        std::thread thread_;
+
+        static std::string path(const std::string& user) { return "certs/" + user + ".cert.pem"; }
+
+        // The user whose certificate file name is, or "" for anything else,
+        // like the temporary files certificates are written to first.
+        static std::string user_of(const std::string& name) {
+            static const std::string suffix = ".cert.pem";
+            if (name.size() <= suffix.size() || name[0] == '.'
+                || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) {
+                return "";
+            }
+            return name.substr(0, name.size() - suffix.size());
+        }
+
+        static CertificateRef load(const std::string& user) {
+            std::ifstream f(path(user), std::ifstream::binary);
+            if (!f) {
+                return nullptr;
+            }
+            std::string pem((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+            return std::make_shared<const StoredCertificate>(std::move(pem));
+        }
+
+        // Keeps cert for user if certs/ has not changed since version.
+        void keep(const std::string& user, CertificateRef cert, uint64_t version) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (inotify_fd_ >= 0 && version_ == version) {
+                certs_[user] = std::move(cert);
+            }
+        }
+
+        void run() {
+            char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            while (!stopping_) {
+                struct pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {wake_fd_, POLLIN, 0}};
+                poll(fds, 2, -1);
+                if (!(fds[0].revents & POLLIN)) {
+                    continue;
+                }
+                ssize_t len = read(inotify_fd_, events, sizeof(events));
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (ssize_t pos = 0; pos < len; ) {
+                    const struct inotify_event *event = reinterpret_cast<const struct inotify_event*>(events + pos);
+                    pos += sizeof(struct inotify_event) + event->len;
+                    if (event->mask & IN_Q_OVERFLOW) {
+                        certs_.clear();
+                    } else if (event->len > 0) {
+                        certs_.erase(user_of(event->name));
+                    }
+                    version_++;
+                }
+            }
+        }
+
+    public:
+        CertStore(const CertStore&) = delete;
+        CertStore& operator=(const CertStore&) = delete;
+
+        CertStore() {
+            inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (inotify_fd_ >= 0 && inotify_add_watch(inotify_fd_, "certs",
+                    IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR) < 0) {
+                close(inotify_fd_);
+                inotify_fd_ = -1;
+            }
+            if (inotify_fd_ < 0) {
+                return;
+            }
+            wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (wake_fd_ < 0) {
+                throw std::runtime_error("CertStore: error creating eventfd");
+            }
+            thread_ = std::thread([this] { run(); });
+        }
+
+        ~CertStore() {
+            if (inotify_fd_ < 0) {
+                return;
+            }
+            stopping_ = true;
+            uint64_t one = 1;
+            write(wake_fd_, &one, sizeof(one));
+            thread_.join();
+            close(inotify_fd_);
+            close(wake_fd_);
+        }
+
+        // Reads every certificate in certs/ with up to threads threads.
+        void preload(unsigned threads) {
+            if (inotify_fd_ < 0) {
+                return;
+            }
+            std::vector<std::string> users;
+            if (DIR *dirp = opendir("certs")) {
+                while (struct dirent *entry = readdir(dirp)) {
+                    std::string user = user_of(entry->d_name);
+                    if (!user.empty()) {
+                        users.push_back(user);
+                    }
+                }
+                closedir(dirp);
+            }
+            std::atomic<size_t> next{0};
+            std::vector<std::thread> loaders;
+            size_t count = std::min<size_t>(std::max(1u, threads), users.size());
+            for (size_t i = 0; i < count; i++) {
+                loaders.emplace_back([this, &users, &next] {
+                    for (size_t i = next++; i < users.size(); i = next++) {
+                        uint64_t version;
+                        {
+                            std::lock_guard<std::mutex> lock(mutex_);
+                            version = version_;
+                        }
+                        if (CertificateRef cert = load(users[i])) {
+                            keep(users[i], std::move(cert), version);
+                        }
+                    }
+                });
+            }
+            for (std::thread& loader : loaders) {
+                loader.join();
+            }
+        }
+
+        // The certificate on file for user, or null if there is none or
+        // user is not a name that can be on file.
+        CertificateRef get(const std::string& user) {
+            if (!valid_username(user)) {
+                return nullptr;
+            }
+            uint64_t version;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = certs_.find(user);
+                if (it != certs_.end()) {
+                    return it->second;
+                }
+                version = version_;
+            }
+            CertificateRef cert = load(user);
+            if (cert != nullptr) {
+                keep(user, cert, version);
+            }
+            return cert;
+        }
+
+        // Records the certificate just installed for user.
+        void put(const std::string& user, const std::string& pem) {
+            if (!valid_username(user)) {
+                return;
+            }
+            CertificateRef cert = std::make_shared<const StoredCertificate>(pem);
+            std::lock_guard<std::mutex> lock(mutex_);
+            version_++;
+            if (inotify_fd_ >= 0) {
+                certs_[user] = std::move(cert);
+            }
+        }
+
+        size_t size() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return certs_.size();
+        }
+    };
+
+} // namespace my
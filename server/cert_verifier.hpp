@@ -0,0 +1,109 @@
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <time.h>
+#include <unordered_map>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <openssl/x509_vfy.h>
+
+namespace my {
+
+    // Checks the certificates clients present for the identity challenge
+    // against the CA chain, the way `openssl verify -CAfile` did, but in
+    // process and with the trust store loaded once. A certificate that
+    // passed is remembered by its SHA-256 fingerprint until its notAfter, in
+    // an LRU cache of at most capacity entries, so a client that comes back
+    // costs a hash and a lookup. Only successes are cached: a certificate
+    // that failed may be one that is not valid yet.
+    class CertVerifier {
+        struct Entry {
+            std::string fingerprint;
+            time_t not_after;
+        };
+
+        X509_STORE *store_;
+        size_t capacity_;
+        std::mutex mutex_;
+        std::list<Entry> lru_;  // most recently used first
+        std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+
+        static time_t not_after(X509 *cert) {
+            struct tm tm;
+            if (ASN1_TIME_to_tm(X509_get0_notAfter(cert), &tm) != 1) {
+                return 0;
+            }
+            return timegm(&tm);
+        }
+
+    public:
+        CertVerifier(const CertVerifier&) = delete;
+        CertVerifier& operator=(const CertVerifier&) = delete;
+
+        CertVerifier(const std::string& ca_file, size_t capacity) : store_(X509_STORE_new()), capacity_(capacity) {
+            if (store_ == nullptr || X509_STORE_load_locations(store_, ca_file.c_str(), nullptr) != 1) {
+                X509_STORE_free(store_);
+                ERR_clear_error();
+                throw std::runtime_error("CertVerifier: error loading " + ca_file);
+            }
+        }
+
+        ~CertVerifier() { X509_STORE_free(store_); }
+
+        // The SHA-256 digest of cert's DER encoding, or "" if it cannot be taken.
+        static std::string fingerprint(X509 *cert) {
+            unsigned char md[EVP_MAX_MD_SIZE];
+            unsigned int md_len = 0;
+            if (X509_digest(cert, EVP_sha256(), md, &md_len) != 1) {
+                ERR_clear_error();
+                return "";
+            }
+            return std::string(reinterpret_cast<char*>(md), md_len);
+        }
+
+        // Whether cert was issued under the CA chain and is valid now.
+        bool verify(X509 *cert) {
+            std::string key = fingerprint(cert);
+            if (key.empty()) {
+                return false;
+            }
+            time_t now = time(nullptr);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = index_.find(key);
+                if (it != index_.end()) {
+                    if (now < it->second->not_after) {
+                        lru_.splice(lru_.begin(), lru_, it->second);
+                        return true;
+                    }
+                    lru_.erase(it->second);
+                    index_.erase(it);
+                }
+            }
+
+            X509_STORE_CTX *ctx = X509_STORE_CTX_new();
+            bool ok = ctx != nullptr && X509_STORE_CTX_init(ctx, store_, cert, nullptr) == 1
+                      && X509_verify_cert(ctx) == 1;
+            X509_STORE_CTX_free(ctx);
+            ERR_clear_error();
+            if (!ok || capacity_ == 0) {
+                return ok;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (index_.count(key) == 0) {
+                lru_.push_front(Entry{key, not_after(cert)});
+                index_[key] = lru_.begin();
+                if (lru_.size() > capacity_) {
+                    index_.erase(lru_.back().fingerprint);
+                    lru_.pop_back();
+                }
+            }
+            return true;
+        }
+    };
+
+} // namespace my
@@ -0,0 +1,265 @@
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdexcept>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+namespace my {
+
+    // Nonces for the identity challenge. Each thread draws them from
+    // RAND_bytes in batches of batch_size, so most challenges take one
+    // from memory without calling into the RNG. A batch left over from
+    // before a fork is thrown away: the parent and the child would
+    // otherwise hand out the same ones.
+    class NoncePool {
+    public:
+        static const size_t nonce_size = 16;       // random bytes in a nonce
+        static const size_t text_size = 2 * nonce_size;  // as hex digits
+
+    private:
+        static const size_t batch_size = 64;
+
+        unsigned char bytes_[batch_size * nonce_size];
+        size_t next_ = batch_size;
+        pid_t pid_ = 0;
+
+        NoncePool() {}
+
+        void refill() {
+            if (RAND_bytes(bytes_, sizeof(bytes_)) != 1) {
+                ERR_clear_error();
+                throw std::runtime_error("NoncePool: error in RAND_bytes");
+            }
+            next_ = 0;
+            pid_ = getpid();
+        }
+
+    public:
+        NoncePool(const NoncePool&) = delete;
+        NoncePool& operator=(const NoncePool&) = delete;
+        ~NoncePool() { OPENSSL_cleanse(bytes_, sizeof(bytes_)); }
+
+        static NoncePool& local() {
+            thread_local NoncePool pool;
+            return pool;
+        }
+
+        // Replaces nonce with a fresh one, as text_size lowercase hex
+        // digits, which is what the client sends back.
+        void take(std::string& nonce) {
+            if (next_ == batch_size || pid_ != getpid()) {
+                refill();
+            }
+            static const char hex[] = "0123456789abcdef";
+            unsigned char *bytes = bytes_ + next_ * nonce_size;
+            nonce.resize(text_size);
+            for (size_t i = 0; i < nonce_size; i++) {
+                nonce[2 * i] = hex[bytes[i] >> 4];
+                nonce[2 * i + 1] = hex[bytes[i] & 0xf];
+            }
+            OPENSSL_cleanse(bytes, nonce_size);
+            next_++;
+        }
+    };
+
+    // Encrypts nonce with the public key of cert the way `openssl pkeyutl
+    // -encrypt` did, with PKCS#1 v1.5 padding, which is what the clients
+    // undo with `openssl pkeyutl -decrypt`. The ciphertext is written to
+    // out, of out_size bytes; returns its length, or 0 on failure.
+    inline size_t encrypt_nonce(X509 *cert, const std::string& nonce, unsigned char *out, size_t out_size)
+    {
+        EVP_PKEY *key = X509_get0_pubkey(cert);
+        EVP_PKEY_CTX *ctx = key == nullptr ? nullptr : EVP_PKEY_CTX_new(key, nullptr);
+        size_t len = out_size;
+        bool ok = ctx != nullptr && EVP_PKEY_encrypt_init(ctx) == 1
+                  && EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) == 1
+                  && EVP_PKEY_encrypt(ctx, out, &len, reinterpret_cast<const unsigned char*>(nonce.data()),
+                                      nonce.size()) == 1;
+        EVP_PKEY_CTX_free(ctx);
+        ERR_clear_error();
+        return ok ? len : 0;
+    }
+
+    // Challenges encrypted ahead of time, so that at peak load challenge()
+    // pops a ready one instead of doing the RSA operation. A user gets a
+    // queue with its first challenge, and a background thread running at
+    // SCHED_IDLE priority keeps it topped up to depth from the certificate
+    // of the CertStore it was popped for. Queues nobody has popped from for
+    // ten minutes are dropped. A queue holds challenges for one
+    // certificate, named by its fingerprint: a pop for any other
+    // certificate empties it, which is how one replaced by another worker
+    // process or a peer shard is noticed, and discard() drops it as soon as
+    // this process installs a new one.
+    // Like the logger it is never destroyed, so its thread runs until the
+    // process exits.
+    class ChallengeQueue {
+    public:
+        struct Challenge {
+            std::string nonce;
+            std::string ciphertext;
+        };
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Queue {
+            CertificateRef cert;
+            std::deque<Challenge> ready;
+            Clock::time_point last_used;
+            bool pending = false;  // listed in pending_ or being filled
+        };
+
+        const std::chrono::seconds idle_limit_{600};
+
+        size_t depth_ = 0;
+        std::mutex mutex_;
+        std::condition_variable wanted_;
+        std::unordered_map<std::string, Queue> queues_;
+        std::deque<std::string> pending_;  // users whose queue is short
+
+        ChallengeQueue() {}
+
+        void want(const std::string& user, Queue& queue) {
+            if (!queue.pending && queue.ready.size() < depth_) {
+                queue.pending = true;
+                pending_.push_back(user);
+                wanted_.notify_one();
+            }
+        }
+
+        void drop_idle() {
+            Clock::time_point cutoff = Clock::now() - idle_limit_;
+            for (auto it = queues_.begin(); it != queues_.end();) {
+                if (!it->second.pending && it->second.last_used < cutoff) {
+                    it = queues_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        // Fills the queue of user up to depth, one challenge at a time, with
+        // the lock held only to look at the queue.
+        void fill(std::unique_lock<std::mutex>& lock, const std::string& user) {
+            auto it = queues_.find(user);
+            if (it == queues_.end()) {
+                return;
+            }
+            CertificateRef cert = it->second.cert;
+            lock.unlock();
+            bool complete = cert != nullptr && cert->x509() != nullptr;
+            while (complete) {
+                Challenge challenge;
+                NoncePool::local().take(challenge.nonce);
+                unsigned char ciphertext[1024];
+                size_t len = encrypt_nonce(cert->x509(), challenge.nonce, ciphertext, sizeof(ciphertext));
+                challenge.ciphertext.assign(reinterpret_cast<char*>(ciphertext), len);
+                lock.lock();
+                it = queues_.find(user);
+                complete = len > 0 && it != queues_.end() && it->second.cert->fingerprint() == cert->fingerprint();
+                if (complete && it->second.ready.size() < depth_) {
+                    it->second.ready.push_back(std::move(challenge));
+                }
+                bool full = !complete || it->second.ready.size() >= depth_;
+                lock.unlock();
+                if (full) {
+                    break;
+                }
+            }
+            lock.lock();
+            it = queues_.find(user);
+            if (it != queues_.end()) {
+                it->second.pending = false;
+                // Popped from while it was being filled; a certificate that
+                // could not be read waits for the next pop instead.
+                if (complete) {
+                    want(user, it->second);
+                }
+            }
+        }
+
+        void run() {
+            sched_param param = {};
+            pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (true) {
+                if (pending_.empty()) {
+                    if (wanted_.wait_for(lock, std::chrono::seconds(60)) == std::cv_status::timeout) {
+                        drop_idle();
+                    }
+                    continue;
+                }
+                std::string user = std::move(pending_.front());
+                pending_.pop_front();
+                fill(lock, user);
+            }
+        }
+
+    public:
+        ChallengeQueue(const ChallengeQueue&) = delete;
+        ChallengeQueue& operator=(const ChallengeQueue&) = delete;
+
+        static ChallengeQueue& instance() {
+            static ChallengeQueue *queue = new ChallengeQueue;
+            return *queue;
+        }
+
+        // Starts the background thread, which keeps depth challenges ready
+        // per user. Until it is called, or with a depth of 0, pop() finds
+        // nothing.
+        void start(size_t depth) {
+            depth_ = depth;
+            if (depth_ > 0) {
+                std::thread([this] { run(); }).detach();
+            }
+        }
+
+        // Takes a ready challenge for cert, the certificate on file for
+        // user, and asks for the queue to be topped up from it. Returns false
+        // if there was none; the caller then makes one itself.
+        bool pop(const std::string& user, const CertificateRef& cert, Challenge& challenge) {
+            if (depth_ == 0) {
+                return false;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            Queue& queue = queues_[user];
+            queue.last_used = Clock::now();
+            if (queue.cert == nullptr || queue.cert->fingerprint() != cert->fingerprint()) {
+                queue.ready.clear();
+            }
+            queue.cert = cert;
+            bool found = !queue.ready.empty();
+            if (found) {
+                challenge = std::move(queue.ready.front());
+                queue.ready.pop_front();
+            }
+            want(user, queue);
+            return found;
+        }
+
+        // Drops what was made for the certificate user had until now.
+        void discard(const std::string& user) {
+            if (depth_ == 0) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            queues_.erase(user);
+        }
+    };
+
+} // namespace my
@@ -0,0 +1,180 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace my {
+
+    // The second wire protocol, for requests whose values are binary (the
+    // three parts of a message). A frame is the magic "\0MF1", the 4 byte
+    // big-endian size of the rest, then each field as a 2 byte name size, the
+    // name, a 4 byte value size and the value. Nothing is escaped or split on
+    // "\r\n", so ciphertext arrives exactly as sent. HTTP requests never start
+    // with a NUL byte, so both protocols are served on the same port.
+    const size_t frame_header_size = 8;
+
+    // Whether a message starting with these bytes is a frame; one byte is enough to tell.
+    bool is_frame(const char *data, size_t size)
+    {
+        return size > 0 && data[0] == '\0';
+    }
+
+    // The size of the whole frame data starts with, or 0 while its header
+    // has not fully arrived.
+    size_t frame_size(const char *data, size_t size)
+    {
+        if (size < frame_header_size) {
+            return 0;
+        }
+        if (memcmp(data, "\0MF1", 4) != 0) {
+            throw std::runtime_error("frame_size: bad magic");
+        }
+        const unsigned char *p = reinterpret_cast<const unsigned char*>(data) + 4;
+        return frame_header_size + ((size_t)p[0] << 24 | (size_t)p[1] << 16 | (size_t)p[2] << 8 | p[3]);
+    }
+
+    // Writes a frame that arrives in pieces straight to disk: the value of
+    // each field named in files goes to the file of that name in dir, the
+    // other fields (like recipient) are short and kept as text. Pieces are
+    // written as they come, so memory use does not depend on the size of
+    // the frame. A malformed frame or a failed write is only recorded; the
+    // rest of the frame is then skipped and complete() says false.
+    class FrameSpool {
+        enum State { NAME_SIZE, NAME, VALUE_SIZE, VALUE };
+
+        static const size_t max_name = 255;
+        static const size_t max_text = 1024;
+
+        std::string dir_;
+        std::vector<std::string> files_;
+        State state_ = NAME_SIZE;
+        std::string head_;  // what has arrived of the current size or name
+        size_t need_ = 2;   // bytes still to come of it, or of the value
+        std::string name_;
+        int fd_ = -1;
+        std::map<std::string, std::string> text_;
+        std::set<std::string> written_;
+        bool failed_ = false;
+
+        static size_t read_size(const std::string& bytes) {
+            size_t n = 0;
+            for (char c : bytes) {
+                n = n << 8 | static_cast<unsigned char>(c);
+            }
+            return n;
+        }
+
+        void fail() {
+            failed_ = true;
+            close_file();
+        }
+
+        void close_file() {
+            if (fd_ >= 0) {
+                close(fd_);
+                fd_ = -1;
+            }
+        }
+
+        // Called once the current size, name or value is complete.
+        void next() {
+            switch (state_) {
+            case NAME_SIZE:
+                need_ = read_size(head_);
+                state_ = NAME;
+                if (need_ == 0 || need_ > max_name) {
+                    fail();
+                }
+                break;
+            case NAME:
+                name_ = head_;
+                need_ = 4;
+                state_ = VALUE_SIZE;
+                break;
+            case VALUE_SIZE:
+                need_ = read_size(head_);
+                state_ = VALUE;
+                if (std::find(files_.begin(), files_.end(), name_) != files_.end()) {
+                    fd_ = open((dir_ + "/" + name_).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+                    if (fd_ < 0) {
+                        fail();
+                    }
+                } else if (need_ > max_text) {
+                    fail();
+                } else {
+                    text_[name_].clear();
+                }
+                if (!failed_ && need_ == 0) {
+                    next();
+                }
+                break;
+            case VALUE:
+                if (fd_ >= 0) {
+                    written_.insert(name_);
+                }
+                close_file();
+                need_ = 2;
+                state_ = NAME_SIZE;
+                break;
+            }
+            head_.clear();
+        }
+
+    public:
+        FrameSpool(const FrameSpool&) = delete;
+        FrameSpool& operator=(const FrameSpool&) = delete;
+
+        FrameSpool(const std::string& dir, std::vector<std::string> files) : dir_(dir), files_(std::move(files)) {}
+        ~FrameSpool() { close_file(); }
+
+        // Takes the next piece of the frame, after its 8 byte header.
+        void feed(const char *data, size_t size) {
+            while (size > 0 && !failed_) {
+                size_t n = std::min(size, need_);
+                if (state_ != VALUE) {
+                    head_.append(data, n);
+                } else if (fd_ < 0) {
+                    text_[name_].append(data, n);
+                } else {
+                    for (size_t done = 0; done < n; ) {
+                        ssize_t len = write(fd_, data + done, n - done);
+                        if (len < 0 && errno == EINTR) {
+                            continue;
+                        }
+                        if (len <= 0) {
+                            fail();
+                            return;
+                        }
+                        done += len;
+                    }
+                }
+                data += n;
+                size -= n;
+                need_ -= n;
+                if (need_ == 0) {
+                    next();
+                }
+            }
+        }
+
+        // Whether the whole frame was well formed and every file in it was written.
+        bool complete() const { return !failed_ && state_ == NAME_SIZE && head_.empty(); }
+
+        // Whether the frame had the field name and its value is in its file.
+        bool wrote(const std::string& name) const { return written_.count(name) != 0; }
+
+        // A text field, "" if the frame did not have it.
+        std::string text(const std::string& name) const {
+            auto it = text_.find(name);
+            return it == text_.end() ? std::string() : it->second;
+        }
+    };
+
+} // namespace my
@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace my {
+
+    // Wakes conversations waiting for mail once something is moved into
+    // messages/<user>, or once their wait is over. It uses inotify, so it
+    // also sees mail delivered by the other worker processes and by peer
+    // shards. A mailbox is only watched while someone waits on it; a waiter
+    // must check the mailbox again after watch() to catch mail that arrived
+    // just before. Wake-ups run on the watcher thread and must not block.
+    class MailWatch {
+        typedef std::chrono::steady_clock Clock;
+
+        struct Waiter {
+            Clock::time_point deadline;
+            std::function<void()> wake;
+        };
+
+        struct Mailbox {
+            int wd;
+            std::vector<Waiter> waiters;
+        };
+
+        int max_wait_;
+        int inotify_fd_;
+        int wake_fd_;
+        std::atomic<bool> stopping_{false};
+        std::mutex mutex_;
+        std::map<std::string, Mailbox> mailboxes_;
+        std::map<int, std::string> users_;  // watch descriptor -> user
+        std::thread thread_;
+
+        // Takes the waiters of user out; the caller wakes them once the lock is released.
+        void take_all(std::map<std::string, Mailbox>::iterator it, std::vector<std::function<void()>>& due) {
+            for (Waiter& waiter : it->second.waiters) {
+                due.push_back(std::move(waiter.wake));
+            }
+            inotify_rm_watch(inotify_fd_, it->second.wd);
+            users_.erase(it->second.wd);
+            mailboxes_.erase(it);
+        }
+
+        void run() {
+            char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            while (true) {
+                int timeout = -1;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    Clock::time_point next = Clock::time_point::max();
+                    for (const auto& mailbox : mailboxes_) {
+                        for (const Waiter& waiter : mailbox.second.waiters) {
+                            next = std::min(next, waiter.deadline);
+                        }
+                    }
+                    if (next != Clock::time_point::max()) {
+                        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(next - Clock::now()).count();
+                        timeout = static_cast<int>(std::max<long long>(0, left + 1));
+                    }
+                }
+                struct pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {wake_fd_, POLLIN, 0}};
+                poll(fds, 2, timeout);
+                if (fds[1].revents & POLLIN) {
+                    uint64_t count;
+                    read(wake_fd_, &count, sizeof(count));
+                }
+
+                std::vector<std::function<void()>> due;
+                bool stopping = stopping_;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (fds[0].revents & POLLIN) {
+                        ssize_t len = read(inotify_fd_, events, sizeof(events));
+                        for (ssize_t pos = 0; pos < len; ) {
+                            const struct inotify_event *event = reinterpret_cast<const struct inotify_event*>(events + pos);
+                            pos += sizeof(struct inotify_event) + event->len;
+                            auto user = users_.find(event->wd);
+                            if (user != users_.end()) {
+                                take_all(mailboxes_.find(user->second), due);
+                            }
+                        }
+                    }
+                    Clock::time_point now = Clock::now();
+                    for (auto it = mailboxes_.begin(); it != mailboxes_.end(); ) {
+                        auto& waiters = it->second.waiters;
+                        for (auto waiter = waiters.begin(); waiter != waiters.end(); ) {
+                            if (stopping || waiter->deadline <= now) {
+                                due.push_back(std::move(waiter->wake));
+                                waiter = waiters.erase(waiter);
+                            } else {
+                                ++waiter;
+                            }
+                        }
+                        if (waiters.empty()) {
+                            auto done = it++;
+                            take_all(done, due);
+                        } else {
+                            ++it;
+                        }
+                    }
+                }
+                for (auto& wake : due) {
+                    wake();
+                }
+                if (stopping) {
+                    return;
+                }
+            }
+        }
+
+    public:
+        MailWatch(const MailWatch&) = delete;
+        MailWatch& operator=(const MailWatch&) = delete;
+
+        // Nobody waits longer than max_wait seconds.
+        explicit MailWatch(int max_wait) : max_wait_(max_wait) {
+            inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (inotify_fd_ < 0 || wake_fd_ < 0) {
+                throw std::runtime_error("MailWatch: error creating inotify or eventfd");
+            }
+            thread_ = std::thread([this] { run(); });
+        }
+
+        ~MailWatch() {
+            shutdown();
+            close(inotify_fd_);
+            close(wake_fd_);
+        }
+
+        // When a wait of `seconds` (at most max_wait) that starts now is over.
+        Clock::time_point deadline(int seconds) const {
+            return Clock::now() + std::chrono::seconds(std::max(0, std::min(seconds, max_wait_)));
+        }
+
+        bool stopped() const { return stopping_; }
+
+        // Calls wake once mail arrives for user or at deadline, whichever is
+        // first; right away if the mailbox cannot be watched or the watch is
+        // shutting down.
+        void watch(const std::string& user, Clock::time_point deadline, std::function<void()> wake) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = mailboxes_.find(user);
+                if (it == mailboxes_.end() && !stopping_) {
+                    int wd = inotify_add_watch(inotify_fd_, ("messages/" + user).c_str(), IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+                    if (wd >= 0) {
+                        it = mailboxes_.emplace(user, Mailbox{wd, std::vector<Waiter>()}).first;
+                        users_[wd] = user;
+                    }
+                }
+                if (it != mailboxes_.end() && !stopping_) {
+                    it->second.waiters.push_back(Waiter{deadline, std::move(wake)});
+                    wake = nullptr;
+                }
+            }
+            if (wake) {
+                wake();
+                return;
+            }
+            uint64_t one = 1;
+            write(wake_fd_, &one, sizeof(one));
+        }
+
+        // Has the watcher thread wake everyone waiting on user, as if mail
+        // had come in. The wake-ups never run on the calling thread.
+        void wake_up(const std::string& user) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = mailboxes_.find(user);
+                if (it == mailboxes_.end()) {
+                    return;
+                }
+                for (Waiter& waiter : it->second.waiters) {
+                    waiter.deadline = Clock::now();
+                }
+            }
+            uint64_t one = 1;
+            write(wake_fd_, &one, sizeof(one));
+        }
+
+        // Wakes every waiter and turns later watches into immediate
+        // wake-ups. Safe to call from a signal handler.
+        void stop() {
+            stopping_ = true;
+            uint64_t one = 1;
+            write(wake_fd_, &one, sizeof(one));
+        }
+
+        // Stops and waits until every waiter has been woken.
+        void shutdown() {
+            stop();
+            if (thread_.joinable()) {
+                thread_.join();
+            }
+        }
+    };
+
+} // namespace my
@@ -0,0 +1,610 @@
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <functional>
+#include <limits.h>
+#include <memory>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unordered_map>
+
+namespace my {
+
+    // One raw response to send back. body lists pieces that follow head
+    // without being copied into it, each in memory kept alive by keep or
+    // by the arena; certificates go out from the store this way. When file
+    // is open, its contents follow as the rest of the body and are sent
+    // straight from the page cache (with SSL_sendfile when kernel TLS is
+    // active) instead of being read into a string first. The descriptor is
+    // closed with the response. The head may live in the arena of the
+    // conversation that built it, which then has to outlive the response.
+    struct Response {
+        ArenaString head;
+        size_t head_sent = 0;
+        std::vector<TextView> body;
+        std::vector<std::shared_ptr<const void>> keep;
+        size_t body_next = 0;  // the piece of body being sent
+        size_t piece_sent = 0;
+        int file = -1;
+        size_t file_size = 0;
+        size_t file_sent = 0;
+
+        Response(ArenaString whole) : head(std::move(whole)) {}
+        Response(ArenaString head, std::vector<TextView> body, std::vector<std::shared_ptr<const void>> keep)
+            : head(std::move(head)), body(std::move(body)), keep(std::move(keep)) {
+            skip_sent_pieces();
+        }
+        Response(ArenaString head, int file, size_t file_size)
+            : head(std::move(head)), file(file), file_size(file_size) {}
+        Response(const Response&) = delete;
+        Response& operator=(const Response&) = delete;
+        Response(Response&& other) noexcept
+            : head(std::move(other.head)), head_sent(other.head_sent), body(std::move(other.body)),
+              keep(std::move(other.keep)), body_next(other.body_next), piece_sent(other.piece_sent),
+              file(other.file), file_size(other.file_size), file_sent(other.file_sent) {
+            other.file = -1;
+        }
+        Response& operator=(Response&& other) noexcept {
+            std::swap(head, other.head);
+            std::swap(head_sent, other.head_sent);
+            std::swap(body, other.body);
+            std::swap(keep, other.keep);
+            std::swap(body_next, other.body_next);
+            std::swap(piece_sent, other.piece_sent);
+            std::swap(file, other.file);
+            std::swap(file_size, other.file_size);
+            std::swap(file_sent, other.file_sent);
+            return *this;
+        }
+        ~Response() {
+            if (file >= 0) {
+                close(file);
+            }
+        }
+
+        bool sent() const { return head_sent == head.size() && body_next == body.size() && file_sent == file_size; }
+
+        // The next bytes to send from memory, head first and then body; empty
+        // once only the file is left.
+        TextView next_in_memory() const {
+            if (head_sent < head.size()) {
+                return TextView(head.data() + head_sent, head.size() - head_sent);
+            }
+            if (body_next < body.size()) {
+                return TextView(body[body_next].data + piece_sent, body[body_next].size - piece_sent);
+            }
+            return TextView();
+        }
+
+        // Marks the next len bytes as sent.
+        void advance(size_t len) {
+            while (len > 0 && (head_sent < head.size() || body_next < body.size())) {
+                size_t n = std::min(len, next_in_memory().size);
+                if (head_sent < head.size()) {
+                    head_sent += n;
+                } else {
+                    piece_sent += n;
+                }
+                len -= n;
+                skip_sent_pieces();
+            }
+            file_sent += len;
+        }
+
+        void skip_sent_pieces() {
+            while (body_next < body.size() && piece_sent == body[body_next].size) {
+                body_next++;
+                piece_sent = 0;
+            }
+        }
+    };
+
+    // Sends the next part of response on ssl and returns what SSL_write
+    // would: the number of bytes sent, or <= 0 for SSL_get_error(). Without
+    // kernel TLS what is left of the head and body shares a record with the
+    // start of the file, so a short message costs one record and one write
+    // instead of several; the same bytes are offered again when a
+    // non-blocking write has to be retried.
+    int send_response_part(SSL *ssl, Response& response)
+    {
+        TextView next = response.next_in_memory();
+        size_t file_left = response.file_size - response.file_sent;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+        if (file_left > 0 && BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+            if (next.size == 0) {
+                ossl_ssize_t sent = SSL_sendfile(ssl, response.file, response.file_sent, std::min<size_t>(file_left, 1 << 20), 0);
+                if (sent > 0) {
+                    response.file_sent += sent;
+                }
+                return static_cast<int>(sent);
+            }
+            file_left = 0;
+        }
+#endif
+        char buffer[16384];
+        if (next.size >= sizeof(buffer)) {
+            int sent = SSL_write(ssl, next.data, std::min<size_t>(next.size, INT_MAX));
+            if (sent > 0) {
+                response.advance(sent);
+            }
+            return sent;
+        }
+        // Gathers what is left in memory, then as much of the file as fits.
+        size_t len = 0;
+        auto gather = [&](const char *data, size_t size) {
+            size_t n = std::min(size, sizeof(buffer) - len);
+            memcpy(buffer + len, data, n);
+            len += n;
+        };
+        gather(response.head.data() + response.head_sent, response.head.size() - response.head_sent);
+        for (size_t i = response.body_next; i < response.body.size() && len < sizeof(buffer); i++) {
+            size_t skip = i == response.body_next ? response.piece_sent : 0;
+            gather(response.body[i].data + skip, response.body[i].size - skip);
+        }
+        if (file_left > 0 && len < sizeof(buffer)) {
+            ssize_t got = pread(response.file, buffer + len, std::min(sizeof(buffer) - len, file_left), response.file_sent);
+            if (got <= 0) {
+                throw std::runtime_error("send_response_part: error reading message file");
+            }
+            len += got;
+        }
+        int sent = SSL_write(ssl, buffer, len);
+        if (sent > 0) {
+            response.advance(sent);
+        }
+        return sent;
+    }
+
+    // One client conversation. It is fed complete HTTP requests and returns the
+    // raw responses to send back; done() says whether to close afterwards.
+    // Clients read one response at a time in 1024 byte pieces, so a TLS record
+    // must never carry the end of one response and the start of the next.
+    class Conversation {
+    public:
+        virtual ~Conversation() {}
+        virtual std::vector<Response> on_message(const std::string& request) = 0;
+        virtual bool done() const = 0;
+        // Called once the TLS handshake has finished, before any request.
+        virtual void on_handshake(SSL * /*ssl*/) {}
+        // Whether handling request waits on CAserver; such steps run in a
+        // lane of their own so they cannot hold up mailbox requests.
+        virtual bool ca_bound(const std::string& /*request*/) const { return false; }
+        // Whether the server has room for request; checked before it is
+        // queued, and cheap enough to run on the thread doing the I/O.
+        virtual bool admit(const std::string& /*request*/) { return true; }
+        // Turns the client away because the server or its lane is full;
+        // ends the conversation.
+        virtual std::vector<Response> busy() = 0;
+        // Whether the last step is waiting for an outside event (new mail)
+        // before it answers. The front end then hands park() a wake function,
+        // which may be called on any thread, and calls resume() for the
+        // answer once it has been; resume() may leave the conversation
+        // waiting again.
+        virtual bool waiting() const { return false; }
+        virtual void park(std::function<void()> wake) { wake(); }
+        virtual std::vector<Response> resume() { return std::vector<Response>(); }
+        // Requests with a larger body, or frames with more after their
+        // header, end the conversation.
+        virtual size_t max_body_size() const { return SIZE_MAX; }
+        // Whether the frame whose header has just arrived should be written
+        // out as it is read instead of being buffered. If so, the rest of the
+        // frame goes to spool_data() in pieces, on the thread doing the I/O,
+        // and then the 8 byte header alone goes to on_message() in place of
+        // the frame.
+        virtual bool spool(size_t /*frame_size*/) { return false; }
+        virtual void spool_data(const char * /*data*/, size_t /*size*/) {}
+    };
+
+    // Takes one complete "headers\r\n\r\nbody" message or frame off the front
+    // of the parser's buffer, in the same shape receive_http_message returns.
+    // Returns false when the buffer does not hold a whole message yet.
+    bool extract_http_message(my::HttpParser& parser, std::string& message)
+    {
+        std::string& buffer = parser.buffer();
+        if (my::is_frame(buffer.data(), buffer.size())) {
+            size_t total = my::frame_size(buffer.data(), buffer.size());
+            if (total == 0 || buffer.size() < total) {
+                return false;
+            }
+            if (buffer.size() == total) {
+                message.swap(buffer);
+                buffer.clear();
+            } else {
+                message.assign(buffer, 0, total);
+                buffer.erase(0, total);
+            }
+            return true;
+        }
+        if (parser.parse() == 0) {
+            return false;
+        }
+        message = parser.take();
+        return true;
+    }
+
+    // Event-driven front end: a single thread owns every socket and drives the
+    // TLS handshake, reads and writes from epoll on non-blocking sockets. Once a
+    // whole request has arrived, the conversation step (which may fork openssl
+    // or talk to the CA) runs on the worker pool, and its output is handed back
+    // to the loop through an eventfd. Idle or slow clients cost no threads.
+    class Reactor {
+        enum State { HANDSHAKE, READING, PROCESSING, WRITING };
+
+        struct Connection {
+            uint64_t id;
+            int fd;
+            SSL *ssl;
+            State state = HANDSHAKE;
+            my::HttpParser in;
+            std::string spool_header;  // of the frame being spooled
+            size_t spool_left = 0;     // bytes of it still to be read
+            std::unique_ptr<Conversation> conversation;
+            std::deque<Response> out;  // destroyed before the conversation its heads came from
+
+            ~Connection() {
+                SSL_free(ssl);
+                close(fd);
+            }
+        };
+
+        struct Completion {
+            uint64_t id;
+            std::vector<Response> output;
+            bool failed;
+        };
+
+        static const uint64_t LISTEN_ID = 0;
+        static const uint64_t WAKE_ID = 1;
+
+        SSL_CTX *ctx_;
+        int listen_fd_;
+        int epoll_fd_;
+        int wake_fd_;
+        my::WorkerPool& pool_;
+        my::WorkerPool& ca_lane_;
+        std::function<std::unique_ptr<Conversation>(const std::string& source)> new_conversation_;
+        std::unordered_map<uint64_t, std::unique_ptr<Connection>> connections_;
+        uint64_t next_id_ = WAKE_ID + 1;
+        size_t in_flight_ = 0;
+        std::atomic<bool> stopping_{false};
+
+        std::mutex completions_mutex_;
+        std::vector<Completion> completions_;
+
+        static void set_nonblocking(int fd) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        }
+
+        void watch(Connection& c, uint32_t events, int op = EPOLL_CTL_MOD) {
+            struct epoll_event ev = {};
+            ev.events = events;
+            ev.data.u64 = c.id;
+            epoll_ctl(epoll_fd_, op, c.fd, &ev);
+        }
+
+        void drop(Connection& c) {
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, c.fd, nullptr);
+            connections_.erase(c.id);
+        }
+
+        // Maps an SSL_ERROR_WANT_* to the epoll interest it needs; anything
+        // else means the connection is finished.
+        bool wait_for(Connection& c, int ret) {
+            switch (SSL_get_error(c.ssl, ret)) {
+            case SSL_ERROR_WANT_READ:
+                watch(c, EPOLLIN);
+                return true;
+            case SSL_ERROR_WANT_WRITE:
+                watch(c, EPOLLOUT);
+                return true;
+            default:
+                ERR_clear_error();
+                drop(c);
+                return false;
+            }
+        }
+
+        void turn_away(Connection& c) {
+            std::vector<Response> output = c.conversation->busy();
+            c.out.assign(std::make_move_iterator(output.begin()), std::make_move_iterator(output.end()));
+            c.state = WRITING;
+            advance(c);
+        }
+
+        // Wraps one conversation step for the worker pool: its output is
+        // handed back to the loop through the completion queue.
+        std::function<void()> step_task(uint64_t id, std::function<std::vector<Response>()> step) {
+            return [this, id, step] {
+                Completion done{id, std::vector<Response>(), false};
+                try {
+                    done.output = step();
+                } catch (const std::exception& ex) {
+                    my::log(my::LOG_ERROR) << "Worker exited with exception: " << ex.what();
+                    done.failed = true;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(completions_mutex_);
+                    completions_.push_back(std::move(done));
+                }
+                uint64_t one = 1;
+                write(wake_fd_, &one, sizeof(one));
+            };
+        }
+
+        void dispatch(Connection& c, std::string request) {
+            Conversation *conversation = c.conversation.get();
+            if (!conversation->admit(request)) {
+                turn_away(c);
+                return;
+            }
+            auto shared_request = std::make_shared<std::string>(std::move(request));
+            auto task = step_task(c.id, [conversation, shared_request] {
+                return conversation->on_message(*shared_request);
+            });
+            if (conversation->ca_bound(*shared_request)) {
+                // The CA lane has bounded concurrency and a bounded queue;
+                // when it is full the client is told to come back later.
+                if (!ca_lane_.try_submit(task)) {
+                    turn_away(c);
+                    return;
+                }
+            } else if (!pool_.try_submit(task)) {
+                // Waiting for room would stall every other connection.
+                turn_away(c);
+                return;
+            }
+            // epoll reports hang-ups even with no events asked for, so the
+            // socket leaves the set until the step's completion comes back.
+            c.state = PROCESSING;
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, c.fd, nullptr);
+            in_flight_++;
+        }
+
+        // Leaves a waiting conversation in PROCESSING, holding no thread, until
+        // it is woken; resume() then runs on the worker pool like any step.
+        void park(Connection& c) {
+            Conversation *conversation = c.conversation.get();
+            auto task = step_task(c.id, [conversation] { return conversation->resume(); });
+            in_flight_++;
+            conversation->park([this, task] { pool_.post(task); });
+        }
+
+        // Starts streaming the frame at the front of c.in to the conversation,
+        // if it takes it; see Conversation::spool(). Whatever of the frame is
+        // already buffered goes out at once.
+        bool start_spool(Connection& c) {
+            std::string& buffer = c.in.buffer();
+            size_t total = my::is_frame(buffer.data(), buffer.size()) ? my::frame_size(buffer.data(), buffer.size()) : 0;
+            if (total == 0) {
+                return false;
+            }
+            if (total - my::frame_header_size > c.conversation->max_body_size()) {
+                throw std::runtime_error("frame too large.");
+            }
+            if (!c.conversation->spool(total)) {
+                return false;
+            }
+            size_t have = std::min(buffer.size(), total);
+            c.spool_header.assign(buffer, 0, my::frame_header_size);
+            c.conversation->spool_data(buffer.data() + my::frame_header_size, have - my::frame_header_size);
+            buffer.erase(0, have);
+            c.spool_left = total - have;
+            return true;
+        }
+
+        // Runs the connection forward until it would block.
+        void advance(Connection& c) {
+            char buffer[16384];
+            while (true) {
+                if (c.state == HANDSHAKE) {
+                    int ret = SSL_do_handshake(c.ssl);
+                    if (ret != 1) {
+                        wait_for(c, ret);
+                        return;
+                    }
+                    c.conversation->on_handshake(c.ssl);
+                    c.state = READING;
+                } else if (c.state == READING && c.spool_left > 0) {
+                    int len = SSL_read(c.ssl, buffer, static_cast<int>(std::min(sizeof(buffer), c.spool_left)));
+                    if (len <= 0) {
+                        wait_for(c, len);
+                        return;
+                    }
+                    c.conversation->spool_data(buffer, len);
+                    c.spool_left -= len;
+                    if (c.spool_left == 0) {
+                        dispatch(c, std::move(c.spool_header));
+                        return;
+                    }
+                } else if (c.state == READING) {
+                    std::string request;
+                    try {
+                        if (start_spool(c)) {
+                            if (c.spool_left == 0) {
+                                dispatch(c, std::move(c.spool_header));
+                                return;
+                            }
+                            continue;
+                        }
+                        if (my::extract_http_message(c.in, request)) {
+                            dispatch(c, std::move(request));
+                            return;
+                        }
+                    } catch (const std::exception& ex) {
+                        my::log(my::LOG_ERROR) << "Worker exited with exception: " << ex.what();
+                        drop(c);
+                        return;
+                    }
+                    int len = SSL_read(c.ssl, buffer, sizeof(buffer));
+                    if (len <= 0) {
+                        wait_for(c, len);
+                        return;
+                    }
+                    c.in.buffer().append(buffer, len);
+                } else if (c.state == WRITING) {
+                    if (!c.out.empty() && c.out.front().sent()) {
+                        c.out.pop_front();
+                        continue;
+                    }
+                    if (c.out.empty()) {
+                        if (c.conversation->done()) {
+                            SSL_shutdown(c.ssl);
+                            drop(c);
+                            return;
+                        }
+                        c.state = READING;
+                        continue;
+                    }
+                    int len;
+                    try {
+                        len = my::send_response_part(c.ssl, c.out.front());
+                    } catch (const std::exception& ex) {
+                        my::log(my::LOG_ERROR) << "Worker exited with exception: " << ex.what();
+                        drop(c);
+                        return;
+                    }
+                    if (len <= 0) {
+                        wait_for(c, len);
+                        return;
+                    }
+                } else {
+                    return;
+                }
+            }
+        }
+
+        void accept_connections() {
+            while (true) {
+                int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0) {
+                    return;
+                }
+                SSL *ssl = SSL_new(ctx_);
+                if (ssl == nullptr) {
+                    close(fd);
+                    ERR_clear_error();
+                    continue;
+                }
+                SSL_set_fd(ssl, fd);
+                SSL_set_accept_state(ssl);
+                SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+                std::unique_ptr<Connection> conn(new Connection);
+                conn->id = next_id_++;
+                conn->fd = fd;
+                conn->ssl = ssl;
+                try {
+                    conn->conversation = new_conversation_(my::peer_address(fd));
+                    conn->in = my::HttpParser(conn->conversation->max_body_size());
+                } catch (const std::exception& ex) {
+                    my::log(my::LOG_ERROR) << "Worker exited with exception: " << ex.what();
+                    continue;
+                }
+                Connection& c = *conn;
+                connections_[c.id] = std::move(conn);
+                watch(c, EPOLLIN, EPOLL_CTL_ADD);
+                advance(c);
+            }
+        }
+
+        void collect_completions() {
+            uint64_t count;
+            read(wake_fd_, &count, sizeof(count));
+            std::vector<Completion> done;
+            {
+                std::lock_guard<std::mutex> lock(completions_mutex_);
+                done.swap(completions_);
+            }
+            for (Completion& completion : done) {
+                in_flight_--;
+                auto it = connections_.find(completion.id);
+                if (it == connections_.end()) {
+                    continue;
+                }
+                Connection& c = *it->second;
+                if (completion.failed) {
+                    drop(c);
+                    continue;
+                }
+                if (completion.output.empty() && c.conversation->waiting()) {
+                    park(c);
+                    continue;
+                }
+                c.out.assign(std::make_move_iterator(completion.output.begin()),
+                             std::make_move_iterator(completion.output.end()));
+                c.state = WRITING;
+                watch(c, EPOLLOUT, EPOLL_CTL_ADD);
+                advance(c);
+            }
+        }
+
+    public:
+        Reactor(const Reactor&) = delete;
+        Reactor& operator=(const Reactor&) = delete;
+
+        explicit Reactor(SSL_CTX *ctx, int listen_fd, my::WorkerPool& pool, my::WorkerPool& ca_lane,
+                         std::function<std::unique_ptr<Conversation>(const std::string& source)> new_conversation)
+            : ctx_(ctx), listen_fd_(listen_fd), pool_(pool), ca_lane_(ca_lane),
+              new_conversation_(std::move(new_conversation)) {
+            epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+            wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (epoll_fd_ < 0 || wake_fd_ < 0) {
+                throw std::runtime_error("Reactor: error creating epoll or eventfd");
+            }
+            set_nonblocking(listen_fd_);
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.u64 = LISTEN_ID;
+            epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+            ev.data.u64 = WAKE_ID;
+            epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+        }
+
+        ~Reactor() {
+            connections_.clear();
+            close(wake_fd_);
+            close(epoll_fd_);
+        }
+
+        // Safe to call from a signal handler.
+        void stop() {
+            stopping_ = true;
+            uint64_t one = 1;
+            write(wake_fd_, &one, sizeof(one));
+        }
+
+        // Serves until stop(), then waits for the requests already handed to
+        // the worker pool before returning.
+        void run() {
+            struct epoll_event events[256];
+            while (!stopping_ || in_flight_ > 0) {
+                if (stopping_ && listen_fd_ >= 0) {
+                    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, listen_fd_, nullptr);
+                    listen_fd_ = -1;
+                }
+                int n = epoll_wait(epoll_fd_, events, 256, -1);
+                if (n < 0 && errno != EINTR) {
+                    break;
+                }
+                for (int i = 0; i < n; i++) {
+                    uint64_t id = events[i].data.u64;
+                    if (id == LISTEN_ID) {
+                        if (listen_fd_ >= 0) {
+                            accept_connections();
+                        }
+                    } else if (id == WAKE_ID) {
+                        collect_completions();
+                    } else {
+                        auto it = connections_.find(id);
+                        if (it != connections_.end()) {
+                            advance(*it->second);
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+} // namespace my
@@ -1,3 +1,4 @@
+#include <array>
 #include <memory>
 #include <signal.h>
 #include <stdexcept>
@@ -9,20 +10,49 @@
 #include <vector>
 #include <iostream>
 #include <map>
+#include <set>
 #include <fstream>
+#include <unordered_map>
 #include <streambuf>
 #include <dirent.h>
+#include <mutex>
+#include <thread>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <poll.h>
 
 #include <openssl/bio.h>
 #include <openssl/err.h>
+#include <openssl/pem.h>
 #include <openssl/ssl.h>
 
+#include "../common/http_parser.hpp"
+#include "../common/request_schema.hpp"
+#include "../common/logger.hpp"
+#include "worker_pool.hpp"
+#include "framing.hpp"
+#include "admission.hpp"
+#include "arena.hpp"
+#include "reactor.hpp"
+#include "shard_map.hpp"
+#include "session_tickets.hpp"
+#include "auth_tokens.hpp"
+#include "mail_watch.hpp"
+#include "cert_verifier.hpp"
+#include "cert_store.hpp"
+#include "challenge.hpp"
+
 namespace my {
 
 template<class T> struct DeleterOf;
 template<> struct DeleterOf<BIO> { void operator()(BIO *p) const { BIO_free_all(p); } };
 template<> struct DeleterOf<BIO_METHOD> { void operator()(BIO_METHOD *p) const { BIO_meth_free(p); } };
 template<> struct DeleterOf<SSL_CTX> { void operator()(SSL_CTX *p) const { SSL_CTX_free(p); } };
+template<> struct DeleterOf<X509> { void operator()(X509 *p) const { X509_free(p); } };
 
 template<class OpenSSLType>
 using UniquePtr = std::unique_ptr<OpenSSLType, DeleterOf<OpenSSLType>>;
@@ -81,66 +111,55 @@ SSL *get_ssl(BIO *bio)
     SSL *ssl = nullptr;
     BIO_get_ssl(bio, &ssl);
     if (ssl == nullptr) {
-        my::print_errors_and_exit("Error in BIO_get_ssl");
+        my::print_errors_and_throw("Error in BIO_get_ssl");
     }
     return ssl;
 }
 
-std::string receive_some_data(BIO *bio)
+// Reads the rest of a frame whose first bytes are in message. If the
+// conversation spools it (see Conversation::spool), the frame is passed on
+// in pieces of at most 16K as it is read, and only its header is returned.
+std::string receive_frame(BIO *bio, std::string message, size_t max_body_size, my::Conversation *conversation)
 {
-    char buffer[1024];
-    int len = BIO_read(bio, buffer, sizeof(buffer));
-    if (len < 0) {
-        my::print_errors_and_throw("error in BIO_read");
-    } else if (len > 0) {
-        return std::string(buffer, len);
-    } else if (BIO_should_retry(bio)) {
-        return receive_some_data(bio);
-    } else {
-        my::print_errors_and_throw("empty BIO_read");
+    size_t total;
+    while ((total = my::frame_size(message.data(), message.size())) == 0) {
+        my::receive_some_data(bio, message, my::frame_header_size);
     }
-}
-
-std::vector<std::string> split_headers(const std::string& text)
-{
-    std::vector<std::string> lines;
-    const char *start = text.c_str();
-    while (const char *end = strstr(start, "\r\n")) {
-        lines.push_back(std::string(start, end));
-        start = end + 2;
+    if (total - my::frame_header_size > max_body_size) {
+        my::print_errors_and_throw("frame too large.");
     }
-    return lines;
-}
-
-std::string receive_http_message(BIO *bio)
-{
-    std::string headers = my::receive_some_data(bio);
-    char *end_of_headers = strstr(&headers[0], "\r\n\r\n");
-    while (end_of_headers == nullptr) {
-        headers += my::receive_some_data(bio);
-        end_of_headers = strstr(&headers[0], "\r\n\r\n");
+    if (message.size() > total) {
+        my::print_errors_and_throw("frame length does not match.");
     }
-    std::string body = std::string(end_of_headers+4, &headers[headers.size()]);
-    headers.resize(end_of_headers+2 - &headers[0]);
-    size_t content_length = -1;
-    for (const std::string& line : my::split_headers(headers)) {
-        if (const char *colon = strchr(line.c_str(), ':')) {
-            auto header_name = std::string(&line[0], colon);
-            if (header_name == "Content-Length") {
-                content_length = std::stoul(colon+1);
-            }
+    if (conversation != nullptr && conversation->spool(total)) {
+        std::string header = message.substr(0, my::frame_header_size);
+        conversation->spool_data(message.data() + header.size(), message.size() - header.size());
+        for (size_t left = total - message.size(); left > 0; left -= message.size()) {
+            message.clear();
+            my::receive_some_data(bio, message, std::min<size_t>(left, 16 * 1024));
+            conversation->spool_data(message.data(), message.size());
         }
+        return header;
+    }
+    while (message.size() < total) {
+        my::receive_some_data(bio, message, total - message.size());
     }
-    if (content_length == -1) {
-        my::print_errors_and_throw("empty header or no content length.");
-    } 
-    while (body.size() < content_length) {
-        body += my::receive_some_data(bio);
+    if (message.size() != total) {
+        my::print_errors_and_throw("frame length does not match.");
     }
-    if (content_length != body.size()) {
-        my::print_errors_and_throw("content length does not match.");
+    return message;
+}
+
+// Reads the next request from a client, which is either an HTTP message or a
+// frame; either is refused if its body is larger than max_body_size.
+std::string receive_request(BIO *bio, size_t max_body_size, my::Conversation *conversation = nullptr)
+{
+    my::HttpParser parser(max_body_size);
+    my::receive_some_data(bio, parser.buffer());
+    if (my::is_frame(parser.buffer().data(), parser.buffer().size())) {
+        return my::receive_frame(bio, std::move(parser.buffer()), max_body_size, conversation);
     }
-    return headers + "\r\n" + body;
+    return my::receive_http_message(bio, parser);
 }
 
 void check_body(std::string & body) {
@@ -148,41 +167,53 @@ void check_body(std::string & body) {
         body += "\r\n\r\n";
 }
 
-void send_http_response(BIO *bio, std::string body, int error_code=200)
-{   
-    std::string response = "HTTP/1.1 200 OK\r\n";
-    if (error_code == 200); // do nothing
-    else if (error_code == 403) {
-        response = "HTTP/1.1 403 Forbidden\r\n";
-    }
-    else {
-        response = "HTTP/1.1 0 Unknown Error\r\n";
-    }
+my::ArenaString format_http_head(size_t content_length, int error_code=200, const std::string& headers="",
+                                 my::Arena *arena=nullptr)
+{
+    my::ArenaString response{my::ArenaAllocator<char>(arena)};
+    my::append_http_head(response, content_length, error_code, headers);
+    return response;
+}
+
+// The whole response in one string; with an arena, it is built there.
+my::ArenaString format_http_response(my::TextView body, int error_code=200, const std::string& headers="",
+                                     my::Arena *arena=nullptr)
+{
     // check_body(body); When sending cert, we do not add \r\n at the end.
-    response += "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+    my::ArenaString response{my::ArenaAllocator<char>(arena)};
+    response.reserve(64 + headers.size() + body.size);
+    my::append_http_head(response, body.size, error_code, headers);
+    response.append(body.data, body.size);
+    return response;
+}
 
+// Head and body go out in one write, so they share a TLS record. The
+// buffer is local: the only responses sent this way are short refusals.
+void send_http_response(BIO *bio, const std::string& body, int error_code=200)
+{
+    std::string response;
+    my::append_http_head(response, body.size(), error_code);
+    response += body;
     BIO_write(bio, response.data(), response.size());
-    BIO_write(bio, body.data(), body.size());
     BIO_flush(bio);
 }
 
+// Throws if the server at the other end of ssl did not present a valid
+// certificate for expected_hostname; the connection is then not used.
 void verify_the_certificate(SSL *ssl, const std::string& expected_hostname)
 {
     int err = SSL_get_verify_result(ssl);
     if (err != X509_V_OK) {
-        const char *message = X509_verify_cert_error_string(err);
-        fprintf(stderr, "Certificate verification error: %s (%d)\n", message, err);
-        exit(1);
+        throw std::runtime_error(std::string("Certificate verification error: ") + X509_verify_cert_error_string(err)
+                                 + " (" + std::to_string(err) + ")");
     }
-    X509 *cert = SSL_get_peer_certificate(ssl);
+    my::UniquePtr<X509> cert(SSL_get_peer_certificate(ssl));
     if (cert == nullptr) {
-        fprintf(stderr, "No certificate was presented by the server\n");
-        exit(1);
+        throw std::runtime_error("No certificate was presented by the server");
     }
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
-    if (X509_check_host(cert, expected_hostname.data(), expected_hostname.size(), 0, nullptr) != 1) {
-        fprintf(stderr, "Certificate verification error: X509_check_host\n");
-        exit(1);
+    if (X509_check_host(cert.get(), expected_hostname.data(), expected_hostname.size(), 0, nullptr) != 1) {
+        throw std::runtime_error("Certificate verification error: X509_check_host");
     }
 #else
     // X509_check_host is called automatically during verification,
@@ -191,53 +222,395 @@ void verify_the_certificate(SSL *ssl, const std::string& expected_hostname)
 #endif
 }
 
+// Removes path and, if it is a directory, everything under it, like
+// `rm -rf` without a shell to parse the name. Errors are ignored.
+void remove_tree(const std::string& path)
+{
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) {
+        return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        if (DIR *dirp = opendir(path.c_str())) {
+            while (struct dirent *entry = readdir(dirp)) {
+                if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                    remove_tree(path + "/" + entry->d_name);
+                }
+            }
+            closedir(dirp);
+        }
+        rmdir(path.c_str());
+    } else {
+        unlink(path.c_str());
+    }
+}
+
+// Every connection gets its own directory under tmp/ for the files handed to
+// the openssl command line tools, so concurrent handlers never share them.
+// It is only created once a file is needed, so connections that are turned
+// away never touch the disk.
+class ScratchDir {
+    std::string dir_;
+public:
+    ScratchDir(const ScratchDir&) = delete;
+    ScratchDir& operator=(const ScratchDir&) = delete;
+
+    explicit ScratchDir() {}
+    ~ScratchDir() {
+        if (!dir_.empty()) {
+            remove_tree(dir_);
+        }
+    }
+    std::string path(const std::string& name) {
+        if (dir_.empty()) {
+            char dir_template[] = "tmp/conn.XXXXXX";
+            if (mkdtemp(dir_template) == nullptr) {
+                throw std::runtime_error("ScratchDir: error in mkdtemp");
+            }
+            dir_ = dir_template;
+        }
+        return dir_ + "/" + name;
+    }
+};
+
+// Held while a worker reads or changes one user's mailbox and certificate.
+// The mutex orders the threads of this process; the flock on
+// tmp/<username>.lock orders the worker processes of a prefork server.
+class MailboxLock {
+    std::unique_lock<std::mutex> thread_lock_;
+    int fd_ = -1;
+public:
+    MailboxLock(const MailboxLock&) = delete;
+    MailboxLock& operator=(const MailboxLock&) = delete;
+    MailboxLock(MailboxLock&& other) : thread_lock_(std::move(other.thread_lock_)), fd_(other.fd_) {
+        other.fd_ = -1;
+    }
+
+    explicit MailboxLock(std::mutex& mutex, const std::string& username) : thread_lock_(mutex) {
+        fd_ = open(("tmp/" + username + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd_ < 0) {
+            throw std::runtime_error("MailboxLock: error opening lock file for " + username);
+        }
+        while (flock(fd_, LOCK_EX) != 0) {
+            if (errno != EINTR) {
+                close(fd_);
+                throw std::runtime_error("MailboxLock: error in flock");
+            }
+        }
+    }
+    ~MailboxLock() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+};
+
+MailboxLock lock_mailbox(const std::string& username)
+{
+    static std::mutex table_mutex;
+    static std::map<std::string, std::unique_ptr<std::mutex>> mailbox_mutexes;
+    std::mutex *mailbox_mutex;
+    {
+        std::lock_guard<std::mutex> lock(table_mutex);
+        auto& slot = mailbox_mutexes[username];
+        if (slot == nullptr) {
+            slot.reset(new std::mutex);
+        }
+        mailbox_mutex = slot.get();
+    }
+    return MailboxLock(*mailbox_mutex, username);
+}
+
+// Writes the certificate next to its final name and renames it into place,
+// so a worker in another process never reads a half-written file.
 void write_user_certificate(std::string username, std::string certificate_str)
 {
-    std::ofstream out("certs/" + username + ".cert.pem");
+    char temp_path[] = "certs/.cert.XXXXXX";
+    int fd = mkstemp(temp_path);
+    if (fd < 0) {
+        throw std::runtime_error("write_user_certificate: error in mkstemp");
+    }
+    close(fd);
+    std::ofstream out(temp_path);
     out << certificate_str;
     out.close();
+    if (!out || rename(temp_path, ("certs/" + username + ".cert.pem").c_str()) != 0) {
+        unlink(temp_path);
+        throw std::runtime_error("write_user_certificate: error writing certificate for " + username);
+    }
+    my::ChallengeQueue::instance().discard(username);
 }
 
-my::UniquePtr<BIO> accept_new_tcp_connection(BIO *accept_bio)
+// The subject common name of cert, which is the user it belongs to, or "".
+std::string certificate_user(X509 *cert)
 {
-    if (BIO_do_accept(accept_bio) <= 0) {
-        return nullptr;
+    char name[256];
+    if (X509_NAME_get_text_by_NID(X509_get_subject_name(cert), NID_commonName, name, sizeof(name)) < 0) {
+        ERR_clear_error();
+        return "";
     }
-    return my::UniquePtr<BIO>(BIO_pop(accept_bio));
+    return name;
 }
 
-} // namespace my
-
-std::vector<std::string> splitStringBy(std::string s, std::string delimiter) {
-    std::vector<std::string> splitted;
-    std::string unparsed(s);
-    size_t pos = 0;
-    std::string token;
-    while ((pos = unparsed.find(delimiter)) != std::string::npos) {
-        token = unparsed.substr(0, pos);
-        splitted.push_back(token);
-        unparsed.erase(0, pos + delimiter.length());
-    }
-    splitted.push_back(unparsed);
-    return splitted;
-}
-
-// execute shell command and return the output
-std::string exec(const std::string& cmd) {
-    std::array<char, 128> buffer;
-    std::string result;
-    std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd.c_str(), "r"), pclose);
-    if (!pipe) {
-        std::cerr << "popen() failed!" <<std::endl;
+// Binds server_port on all addresses. With reuse_port every worker process
+// binds a socket of its own and the kernel spreads new connections across them.
+int open_listen_socket(const std::string& port, bool reuse_port)
+{
+    int one = 1;
+    int zero = 0;
+    struct sockaddr_in6 addr6 = {};
+    addr6.sin6_family = AF_INET6;
+    addr6.sin6_addr = in6addr_any;
+    addr6.sin6_port = htons(std::stoi(port));
+    struct sockaddr_in addr4 = {};
+    addr4.sin_family = AF_INET;
+    addr4.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr4.sin_port = addr6.sin6_port;
+
+    // Prefer one dual-stack socket; fall back to IPv4 where IPv6 is disabled.
+    struct sockaddr *addr = reinterpret_cast<struct sockaddr*>(&addr6);
+    socklen_t addr_len = sizeof(addr6);
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0) {
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    } else {
+        addr = reinterpret_cast<struct sockaddr*>(&addr4);
+        addr_len = sizeof(addr4);
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    }
+    if (fd < 0) {
+        perror("Error in socket");
+        exit(1);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+        perror("Error setting SO_REUSEPORT");
+        exit(1);
+    }
+    if (bind(fd, addr, addr_len) != 0 || listen(fd, SOMAXCONN) != 0) {
+        perror("Error binding server_port");
         exit(1);
     }
-    while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-        result += buffer.data();
+    return fd;
+}
+
+my::UniquePtr<BIO> accept_new_tcp_connection(int listen_fd)
+{
+    int fd;
+    do {
+        fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    } while (fd < 0 && (errno == EINTR || errno == ECONNABORTED));
+    if (fd < 0) {
+        return nullptr;
     }
-    if (result.back()=='\n') result.pop_back();
-    return result;
+    return my::UniquePtr<BIO>(BIO_new_socket(fd, BIO_CLOSE));
 }
 
+// Verified TLS connections to CAserver (or to another shard of the cluster),
+// kept open between requests so that a getcert or changepw costs one round
+// trip instead of a connect, a full handshake and a reload of the trust store.
+class TLSConnectionPool {
+    my::UniquePtr<SSL_CTX> ctx_;
+    std::string url_;
+    std::string hostname_;
+    size_t max_idle_;
+    std::mutex mutex_;
+    std::vector<my::UniquePtr<BIO>> idle_;
+
+    static bool send(BIO *CAssl_bio, const std::string& request)
+    {
+        return BIO_write(CAssl_bio, request.data(), request.size()) > 0 && BIO_flush(CAssl_bio) > 0;
+    }
+
+    // Whether an idle connection is still open. CAserver sends nothing
+    // unasked but session tickets, so anything else waiting to be read,
+    // an end of file included, means it has closed the connection.
+    static bool still_open(BIO *CAssl_bio)
+    {
+        int fd = BIO_get_fd(CAssl_bio, nullptr);
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (fd < 0 || poll(&pfd, 1, 0) < 0) {
+            return false;
+        }
+        if (pfd.revents == 0) {
+            return true;
+        }
+        SSL *ssl = my::get_ssl(CAssl_bio);
+        int flags = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        char byte;
+        int len = SSL_peek(ssl, &byte, 1);
+        bool open = len <= 0 && SSL_get_error(ssl, len) == SSL_ERROR_WANT_READ;
+        fcntl(fd, F_SETFL, flags);
+        ERR_clear_error();
+        return open;
+    }
+
+public:
+    TLSConnectionPool(const TLSConnectionPool&) = delete;
+    TLSConnectionPool& operator=(const TLSConnectionPool&) = delete;
+
+    explicit TLSConnectionPool(const std::string& url, size_t max_idle, const std::string& hostname = "luckluckgo.com")
+        : url_(url), hostname_(hostname), max_idle_(max_idle) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+        ctx_.reset(SSL_CTX_new(SSLv23_client_method()));
+#else
+        ctx_.reset(SSL_CTX_new(TLS_client_method()));
+#endif
+        // edit this to trust a local certificate
+        // if (SSL_CTX_set_default_verify_paths(ctx.get()) != 1) {
+        // use the ca's certificate here
+        if (SSL_CTX_load_verify_locations(ctx_.get(), "ca-chain.cert.pem", nullptr) != 1) {
+            my::print_errors_and_exit("Error setting up trust store");
+        }
+    }
+
+    // A new connection outside the pool, for a conversation of its own.
+    my::UniquePtr<BIO> connect()
+    {
+        auto CAbio = my::UniquePtr<BIO>(BIO_new_connect(url_.c_str()));
+        if (CAbio == nullptr) {
+            my::print_errors_and_throw("Error in BIO_new_connect");
+        }
+        if (BIO_do_connect(CAbio.get()) <= 0) {
+            my::print_errors_and_throw("Error in BIO_do_connect");
+        }
+        auto CAssl_bio = std::move(CAbio)
+                       | my::UniquePtr<BIO>(BIO_new_ssl(ctx_.get(), 1))
+        ;
+        SSL_set_tlsext_host_name(my::get_ssl(CAssl_bio.get()), hostname_.c_str());
+        if (BIO_do_handshake(CAssl_bio.get()) <= 0) {
+            my::print_errors_and_throw("Error in BIO_do_handshake");
+        }
+        my::verify_the_certificate(my::get_ssl(CAssl_bio.get()), hostname_);
+        return CAssl_bio;
+    }
+
+    // Opens the idle connections ahead of the first request. CAserver may not
+    // be up yet, in which case connections are made on demand instead.
+    void warm()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        try {
+            while (idle_.size() < max_idle_) {
+                idle_.push_back(connect());
+            }
+        } catch (const std::exception& ex) {
+            my::log(my::LOG_WARN) << "CAserver not reachable yet: " << ex.what();
+        }
+    }
+
+    // Sends one request and returns the response. A pooled connection that
+    // CAserver has closed in the meantime (e.g. because it restarted) is
+    // replaced by a fresh one, and so is one the request could not be
+    // written to. Once the request is out it is never sent again: getcert
+    // and changepw are not idempotent, and a lost reply may be for a
+    // certificate already issued or a password already changed.
+    std::string request(const std::string& request)
+    {
+        my::UniquePtr<BIO> CAssl_bio;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!idle_.empty()) {
+                CAssl_bio = std::move(idle_.back());
+                idle_.pop_back();
+            }
+        }
+        if (CAssl_bio != nullptr && (!still_open(CAssl_bio.get()) || !send(CAssl_bio.get(), request))) {
+            ERR_clear_error();
+            CAssl_bio.reset();
+        }
+        if (CAssl_bio == nullptr) {
+            CAssl_bio = connect();
+            if (!send(CAssl_bio.get(), request)) {
+                my::print_errors_and_throw("error in BIO_write");
+            }
+        }
+        std::string response = my::receive_http_message(CAssl_bio.get());
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (idle_.size() < max_idle_) {
+            idle_.push_back(std::move(CAssl_bio));
+        }
+        return response;
+    }
+};
+
+// This server's place in a sharded cluster: the shard map, plus a way to
+// reach the other shards for the users they own. Shards trust each other's
+// internal requests by the shared cluster_secret.
+class Cluster {
+    my::ShardMap shards_;
+    std::string secret_;
+    std::map<std::string, std::unique_ptr<my::TLSConnectionPool>> peers_;
+
+public:
+    Cluster(const Cluster&) = delete;
+    Cluster& operator=(const Cluster&) = delete;
+
+    explicit Cluster(const std::map<std::string, std::string>& config) : shards_(config) {
+        if (config.count("cluster_secret")) {
+            secret_ = config.at("cluster_secret");
+        }
+        if (shards_.clustered() && secret_.empty()) {
+            throw std::runtime_error("Cluster: shards are configured but cluster_secret is not");
+        }
+        // It travels as a form parameter, which is not decoded, so '&', '='
+        // and anything that would end the line cannot be part of it.
+        if (secret_.find_first_of("&= \t\r\n") != std::string::npos) {
+            throw std::runtime_error("Cluster: cluster_secret may not contain '&', '=' or whitespace");
+        }
+        for (const auto& shard : shards_.shards()) {
+            if (shard.first != shards_.local()) {
+                // Shards present the mail server's own certificate. A shard
+                // ends the connection after each internal request, as it does
+                // for clients, so there is nothing worth keeping idle.
+                peers_[shard.first].reset(new my::TLSConnectionPool(shard.second, 0, "duckduckgo.com"));
+            }
+        }
+    }
+
+    const my::ShardMap& shards() const { return shards_; }
+    bool owns(const std::string& username) const { return shards_.owns(username); }
+
+    bool authentic(const std::string& secret) const
+    {
+        return !secret_.empty() && secret.size() == secret_.size()
+            && CRYPTO_memcmp(secret.data(), secret_.data(), secret_.size()) == 0;
+    }
+
+    // A fresh connection to the shard owning username, for the router to
+    // hand a client's whole conversation over to.
+    my::UniquePtr<BIO> connect_to_owner(const std::string& username)
+    {
+        return peers_.at(shards_.owner(username))->connect();
+    }
+
+    // Sends an internal request to the shard owning username. fields are the
+    // form parameters, payload follows on the next line as raw bytes. Returns
+    // the response body, or false if the shard refused the request or could
+    // not be reached.
+    bool request(const std::string& username, const std::string& fields, const std::string& payload,
+                 std::string& response_body)
+    {
+        std::string body = fields + "&secret=" + secret_ + "\r\n" + payload;
+        std::string request = "POST / HTTP/1.1\r\n";
+        request += "Host: duckduckgo.com\r\n";
+        request += "Content-Type: application/octet-stream\r\n";
+        request += "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+        std::string response;
+        try {
+            response = peers_.at(shards_.owner(username))->request(request);
+        } catch (const std::exception& ex) {
+            my::log(my::LOG_WARN) << "Shard " << shards_.owner(username) << " not reachable: " << ex.what();
+            return false;
+        }
+        response_body = response.substr(response.find("\r\n\r\n") + 4);
+        return response.compare(0, 15, "HTTP/1.1 200 OK") == 0;
+    }
+};
+
+} // namespace my
+
 std::map<std::string, std::string> load_config()
 {
     std::map<std::string, std::string> config_map;
@@ -272,10 +645,84 @@ int count_message_number(std::string path) {
     }
 }
 
-void clean() {
-    // delete "tmp/*"
-    // Next line (may) create a bug.  
-    // system("rm tmp/*");
+// The type field of a client's first request, read straight from the start
+// of the body so the scheduler can route it before the request is parsed.
+my::TextView request_type(const std::string& request)
+{
+    size_t body = request.find("\r\n\r\n");
+    if (body == std::string::npos || request.compare(body + 4, 5, "type=") != 0) {
+        return my::TextView();
+    }
+    size_t start = body + 9;
+    size_t end = request.find_first_of("&\r", start);
+    return my::TextView(request.data() + start, (end == std::string::npos ? request.size() : end) - start);
+}
+
+// The user a client's first request acts for: the username of a getcert or
+// changepw, or the subject of the certificate (or the holder of the token)
+// presented with a sendmsg or recvmsg. The router sends the conversation to
+// the shard owning that user; whether the proof is genuine is left to the shard.
+std::string request_owner(const std::string& request)
+{
+    std::vector<my::TextView> requestLines = my::split(request, "\r\n");
+    if (requestLines.size() < 6) {
+        return "";
+    }
+    my::FormParams paramMap(requestLines[5]);
+    my::RequestType type = my::request_type_of(paramMap["type"]);
+    if (type == my::RequestType::GETCERT || type == my::RequestType::CHANGEPW) {
+        return paramMap["username"].str();
+    }
+    if (paramMap["auth"] == "token") {
+        return my::AuthTokens::user_of(paramMap["token"].str());
+    }
+    std::string cert_content;
+    for (size_t i = 6; i < requestLines.size(); i++) {
+        cert_content.append(requestLines[i].data, requestLines[i].size);
+    }
+    auto cert_bio = my::UniquePtr<BIO>(BIO_new_mem_buf(cert_content.data(), cert_content.size()));
+    std::unique_ptr<X509, decltype(&X509_free)> cert(PEM_read_bio_X509(cert_bio.get(), nullptr, nullptr, nullptr), X509_free);
+    ERR_clear_error();
+    char name[256];
+    if (cert == nullptr
+        || X509_NAME_get_text_by_NID(X509_get_subject_name(cert.get()), NID_commonName, name, sizeof(name)) < 0) {
+        return "";
+    }
+    return name;
+}
+
+std::string message_path(const std::string& username, int index)
+{
+    std::string s_index = std::to_string(index);
+    return "messages/" + username + "/" + std::string(5 - s_index.length(), '0') + s_index;
+}
+
+// Moves a message staged in dir (key.bin.enc, id_mail.enc, signature.sign)
+// into the next free slot of the recipient's mailbox on this server.
+bool deliver_message(const std::string& recipient, const std::string& dir)
+{
+    auto mailbox_lock = my::lock_mailbox(recipient);
+    int count = count_message_number("messages/" + recipient);
+    if (count == -1) {
+        mkdir(("messages/" + recipient).c_str(), 0777);
+        count = 0;
+    }
+    return count <= 99999 && rename(dir.c_str(), message_path(recipient, count).c_str()) == 0;
+}
+
+// Hands a message staged in dir to the shard that owns the recipient.
+bool forward_message(my::Cluster& cluster, const std::string& recipient, const std::string& dir)
+{
+    std::string fields = "type=peerdeliver&username=" + recipient;
+    std::string payload;
+    for (const char *part : {"key.bin.enc", "id_mail.enc", "signature.sign"}) {
+        std::ifstream f(dir + "/" + part, std::ifstream::binary);
+        std::string content((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        fields += std::string("&") + part + "=" + std::to_string(content.size());
+        payload += content;
+    }
+    std::string response;
+    return cluster.request(recipient, fields, payload, response);
 }
 
 std::string check_username_and_password(const std::string & username, const std::string & password, const std::string & csr) {
@@ -289,436 +736,1305 @@ std::string check_username_and_password(const std::string & username, const std:
     return request;
 }
 
-int main()
-{
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-    SSL_library_init();
-    SSL_load_error_strings();
-    auto ctx = my::UniquePtr<SSL_CTX>(SSL_CTX_new(SSLv23_method()));
-#else
-    auto ctx = my::UniquePtr<SSL_CTX>(SSL_CTX_new(TLS_method()));
-    SSL_CTX_set_min_proto_version(ctx.get(), TLS1_2_VERSION);
-#endif
+// What the conversations of one server process share.
+struct Services {
+    my::TLSConnectionPool& ca_pool;
+    my::Cluster& cluster;
+    my::AdmissionControl& admission;
+    const my::AuthTokens& tokens;
+    my::MailWatch& mail_watch;
+    my::CertVerifier& verifier;
+    my::CertStore& certs;
+    size_t max_body_size;
+};
 
-    if (SSL_CTX_use_certificate_file(ctx.get(), "mailserver.cert.pem", SSL_FILETYPE_PEM) <= 0) {
-        my::print_errors_and_exit("Error loading server certificate");
-    }
-    if (SSL_CTX_use_PrivateKey_file(ctx.get(), "mailserver.key.pem", SSL_FILETYPE_PEM) <= 0) {
-        my::print_errors_and_exit("Error loading server private key");
-    }
+// The per-connection protocol state machine. Each call to on_message()
+// handles one request of a getcert/changepw/sendmsg/recvmsg conversation and
+// returns the responses to send, so the blocking workers and the epoll
+// reactor drive exactly the same handler code.
+class Session : public my::Conversation {
+    enum Step {
+        START,
+        SENDMSG_NUMBER,
+        SENDMSG_RECIPIENT,
+        SENDMSG_KEY,
+        SENDMSG_ID_MAIL,
+        SENDMSG_SIGNATURE,
+        SENDMSG_SKIP_ID_MAIL,
+        SENDMSG_SKIP_SIGNATURE,
+        RECVMSG_NUMBER,
+        RECVMSG_WAIT,
+        DONE
+    };
 
-    std::map<std::string, std::string> configMap = load_config();
-    std::string CAserver_url = configMap["CAserver_ip"] + ":" + configMap["CAserver_port"];
+    // Scratch memory for one request, released when the next one starts;
+    // see on_message(). Declared first so it outlives everything built in it.
+    my::Arena arena_;
+    my::TLSConnectionPool& ca_pool_;
+    my::Cluster& cluster_;
+    my::AdmissionControl& admission_;
+    const my::AuthTokens& tokens_;
+    my::MailWatch& mail_watch_;
+    my::CertVerifier& verifier_;
+    my::CertStore& certs_;
+    std::string source_;            // address the client connected from
+    bool admitted_ = false;
+    my::ScratchDir scratch_;
+    Step step_ = START;
+    std::vector<my::Response> output_;
+    std::string r_;                 // challenge number sent to the client
+    std::string user_;              // sender or recipient whose certificate was presented
+    my::UniquePtr<X509> peer_cert_; // client certificate verified in the handshake, if any
+    std::string peer_user_;         // its subject
+    std::string token_header_;      // goes out with the next response
+    std::chrono::steady_clock::time_point wait_until_;  // how long recvmsg may wait for mail
+    int remaining_recipients_ = 0;
+    std::set<std::string> recipients_;  // those whose certificate the sender was given
+    std::string curr_recipient_;
+    std::string staged_;
+    std::vector<my::TextView> request_lines_;
+    size_t max_body_size_;
+    std::unique_ptr<my::FrameSpool> spool_;  // the message frame being written to staged_
+
+    void reply(my::TextView body, int error_code=200)
+    {
+        output_.push_back(my::format_http_response(body, error_code, token_header_, &arena_));
+        token_header_.clear();
+    }
 
-    auto accept_bio = my::UniquePtr<BIO>(BIO_new_accept(configMap["server_port"].c_str()));
-    if (BIO_do_accept(accept_bio.get()) <= 0) {
-        my::print_errors_and_exit("Error in BIO_do_accept");
+    // Answers with the contents of the file at path. The file is opened now,
+    // so it can be removed from the mailbox before the response is sent.
+    void reply_file(const std::string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            reply("");
+            return;
+        }
+        output_.emplace_back(my::format_http_head(st.st_size, 200, token_header_, &arena_), fd, st.st_size);
+        token_header_.clear();
     }
 
-    static auto shutdown_the_socket = [fd = BIO_get_fd(accept_bio.get(), nullptr)]() {
-        close(fd);
-    };
-    signal(SIGINT, [](int) { shutdown_the_socket(); });
+    void finish(my::TextView body, int error_code)
+    {
+        reply(body, error_code);
+        step_ = DONE;
+    }
 
-    while (auto bio = my::accept_new_tcp_connection(accept_bio.get())) {
-        bio = std::move(bio)
-            | my::UniquePtr<BIO>(BIO_new_ssl(ctx.get(), 0))
-            ;
+    // Sends request to CAserver and returns its response, or "" when the CA
+    // cannot be reached or fails verification; the caller then refuses the
+    // client as it would a refusal from the CA.
+    std::string ask_ca(const std::string& request)
+    {
         try {
-            std::string request = my::receive_http_message(bio.get());
-            printf("Got request:\n");           
-            // handle request based on type
-            //std::cout << request << std::endl;
-            std::vector<std::string> requestLines = splitStringBy(request, "\r\n");
-
-            std::map<std::string, std::string> paramMap;
-            std::vector<std::string> params = splitStringBy(requestLines[5], "&");
-            for (int i = 0; i < params.size(); i ++) {
-                std::vector <std::string> kv = splitStringBy(params[i], "=");
-                paramMap[kv[0]] = kv[1];
-            }
-
-            if (paramMap["type"].compare("getcert") == 0) {
-                std::cout << "getcert request received from user " << paramMap["username"] << std::endl;
-                std::string username = paramMap["username"];
-                std::string password = paramMap["password"];
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-                SSL_library_init();
-                SSL_load_error_strings();
-#endif
-
-                /* Set up the SSL context */
+            return ca_pool_.request(request);
+        } catch (const std::exception& ex) {
+            my::log(my::LOG_ERROR) << "CAserver request failed: " << ex.what();
+            return "";
+        }
+    }
 
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-                auto ctx = my::UniquePtr<SSL_CTX>(SSL_CTX_new(SSLv23_client_method()));
-#else
-                auto ctx = my::UniquePtr<SSL_CTX>(SSL_CTX_new(TLS_client_method()));
-#endif
-                
-                // edit this to trust a local certificate
-                // if (SSL_CTX_set_default_verify_paths(ctx.get()) != 1) {
-                // use the ca's certificate here
-                if (SSL_CTX_load_verify_locations(ctx.get(), "ca-chain.cert.pem", nullptr) != 1) {
-                    my::print_errors_and_exit("Error setting up trust store");
-                }
-                auto CAbio = my::UniquePtr<BIO>(BIO_new_connect(CAserver_url.c_str()));
-                if (CAbio == nullptr) {
-                    my::print_errors_and_exit("Error in BIO_new_connect");
-                }
-                if (BIO_do_connect(CAbio.get()) <= 0) {
-                    my::print_errors_and_exit("Error in BIO_do_connect");
-                }
-                auto CAssl_bio = std::move(CAbio)
-                               | my::UniquePtr<BIO>(BIO_new_ssl(ctx.get(), 1))
-                ;
-                SSL_set_tlsext_host_name(my::get_ssl(CAssl_bio.get()), "luckluckgo.com");
-                if (BIO_do_handshake(CAssl_bio.get()) <= 0) {
-                    my::print_errors_and_exit("Error in BIO_do_handshake");
-                }
-                my::verify_the_certificate(my::get_ssl(CAssl_bio.get()), "luckluckgo.com");
+    void handle_getcert(const my::GetCertRequest& getcert, const std::vector<my::TextView>& requestLines)
+    {
+        my::log(my::LOG_INFO) << "getcert request received from user " << getcert.username;
+        std::string username = getcert.username.str();
+        std::string password = getcert.password.str();
+        std::string csr = "";
+        for (size_t i = 6; i < requestLines.size(); i ++) {
+            csr.append(requestLines[i].data, requestLines[i].size);
+        }
+        
+        std::string request = check_username_and_password(username, password, csr);
+        std::string response = ask_ca(request);
+        size_t pos = response.find("-----BEGIN CERTIFICATE-----");
+        if (pos != std::string::npos) {
+            auto mailbox_lock = my::lock_mailbox(username);
+            int count = count_message_number("messages/" + username);
+            if (count == -1 || count == 0) {
+                std::string certificate = response.substr(pos, response.size() - pos);
+                my::write_user_certificate(username, certificate);
+                certs_.put(username, certificate);
+                reply(certificate);
+            }
+            else {
+                reply("unread-messages", 403);
+            }
+        } else {
+            reply("failed request", 403);
+        }
+    }
 
-                std::string csr = "";
-                for (int i = 6; i < requestLines.size(); i ++) {
-                    csr += requestLines[i];
-                }
-                
-                std::string request = check_username_and_password(username, password, csr);
-                BIO_write(CAssl_bio.get(), request.data(), request.size());
-                BIO_flush(CAssl_bio.get());
-                std::string response = my::receive_http_message(CAssl_bio.get());
-                size_t pos = response.find("-----BEGIN CERTIFICATE-----");
-                if (pos != std::string::npos) {
-                    int count = count_message_number("messages/" + username);
-                    if (count == -1 || count == 0) {
-                        std::string certificate = response.substr(pos, response.size() - pos);
-                        my::write_user_certificate(paramMap["username"], certificate);
-                        my::send_http_response(bio.get(), certificate);
-                    }
-                    else {
-                        my::send_http_response(bio.get(), "unread-messages", 403);
-                    }
-                } else {
-                    my::send_http_response(bio.get(), "failed request", 403);
-                }
-            } else if (paramMap["type"].compare("changepw") == 0) {
-                std::cout << "changepw request received from user " << paramMap["username"] << std::endl;
-                std::string username = paramMap["username"];
-                std::string old_password = paramMap["old_password"];
-                std::string new_password = paramMap["new_password"];
-                int count = count_message_number("messages/" + username);
-                if (count == -1 || count == 0); // do nothing
-                else {
-                    my::send_http_response(bio.get(), "failed request", 403);
-                    continue;
-                }
+    void handle_changepw(const my::ChangePwRequest& changepw, const std::vector<my::TextView>& requestLines)
+    {
+        my::log(my::LOG_INFO) << "changepw request received from user " << changepw.username;
+        std::string username = changepw.username.str();
+        std::string old_password = changepw.old_password.str();
+        std::string new_password = changepw.new_password.str();
+        auto mailbox_lock = my::lock_mailbox(username);
+        int count = count_message_number("messages/" + username);
+        if (count == -1 || count == 0); // do nothing
+        else {
+            reply("failed request", 403);
+            return;
+        }
 
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-                SSL_library_init();
-                SSL_load_error_strings();
-#endif
+        std::string csr = "";
+        for (size_t i = 6; i < requestLines.size(); i ++) {
+            csr.append(requestLines[i].data, requestLines[i].size);
+        }
 
-                /* Set up the SSL context */
+        std::string fields = "type=changepw&username=" + username + "&old_password=" + old_password + "&new_password=";
+        fields += new_password;
+        std::string body = fields + "\r\n" + csr;
+        // my::check_body(body); When sending cert, we do not add \r\n at the end.
+        std::string request = "POST / HTTP/1.1\r\n";
+        request += "Host: duckduckgo.com\r\n";
+        request += "Content-Type: application/octet-stream\r\n";
+        request += "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+
+        std::string response = ask_ca(request);
+        size_t pos = response.find("-----BEGIN CERTIFICATE-----");
+        if (pos != std::string::npos) {
+            std::string certificate = response.substr(pos, response.size() - pos);
+            my::write_user_certificate(username, certificate);
+            certs_.put(username, certificate);
+            reply(certificate);
+        } else {
+            reply("failed request", 403);
+        }
+    }
 
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-                auto ctx = my::UniquePtr<SSL_CTX>(SSL_CTX_new(SSLv23_client_method()));
-#else
-                auto ctx = my::UniquePtr<SSL_CTX>(SSL_CTX_new(TLS_client_method()));
-#endif
+    // Checks the certificate in the request body against the CA and the copy
+    // in certs/, then sends a fresh nonce encrypted with its public key, made
+    // ahead of time if there is one ready.
+    // role is "sender" or "recipient". Returns false after answering 403.
+    bool challenge(const std::vector<my::TextView>& requestLines, const std::string& role)
+    {
+        std::string cert_content;
+        for (size_t i = 6; i < requestLines.size(); i++) {
+            cert_content.append(requestLines[i].data, requestLines[i].size);
+        }
+        my::UniquePtr<BIO> cert_bio(BIO_new_mem_buf(cert_content.data(), cert_content.size()));
+        my::UniquePtr<X509> presented(PEM_read_bio_X509(cert_bio.get(), nullptr, nullptr, nullptr));
+        ERR_clear_error();
+        if (presented == nullptr || !verifier_.verify(presented.get())) {
+            my::log(my::LOG_INFO) << (role == "sender" ? "Sender" : "Recipient") << "'s certificate is not verified";
+            finish("fake-identity", 403);
+            return false;
+        }
+        // It has to be the certificate on file for the user it names.
+        user_ = my::certificate_user(presented.get());
+        my::CertificateRef on_file = user_.empty() ? nullptr : certs_.get(user_);
+        if (on_file == nullptr || on_file->fingerprint().empty()
+            || on_file->fingerprint() != my::CertVerifier::fingerprint(presented.get())) {
+            finish("fake-identity", 403);
+            return false;
+        }
 
-                // edit this to trust a local certificate
-                // if (SSL_CTX_set_default_verify_paths(ctx.get()) != 1) {
-                // use the ca's certificate here
-                if (SSL_CTX_load_verify_locations(ctx.get(), "ca-chain.cert.pem", nullptr) != 1) {
-                    my::print_errors_and_exit("Error setting up trust store");
-                }
-                auto CAbio = my::UniquePtr<BIO>(BIO_new_connect(CAserver_url.c_str()));
-                if (CAbio == nullptr) {
-                    my::print_errors_and_exit("Error in BIO_new_connect");
-                }
-                if (BIO_do_connect(CAbio.get()) <= 0) {
-                    my::print_errors_and_exit("Error in BIO_do_connect");
-                }
-                auto CAssl_bio = std::move(CAbio)
-                                 | my::UniquePtr<BIO>(BIO_new_ssl(ctx.get(), 1))
-                ;
-                SSL_set_tlsext_host_name(my::get_ssl(CAssl_bio.get()), "luckluckgo.com");
-                if (BIO_do_handshake(CAssl_bio.get()) <= 0) {
-                    my::print_errors_and_exit("Error in BIO_do_handshake");
-                }
-                my::verify_the_certificate(my::get_ssl(CAssl_bio.get()), "luckluckgo.com");
+        my::ChallengeQueue::Challenge ready;
+        if (my::ChallengeQueue::instance().pop(user_, on_file, ready)) {
+            r_ = std::move(ready.nonce);
+            my::log(my::LOG_INFO) << (role == "sender" ? "sendmsg" : "recvmsg") << " request. rand number sent is " << r_;
+            reply(ready.ciphertext);
+            return true;
+        }
+        my::NoncePool::local().take(r_);
+        my::log(my::LOG_INFO) << (role == "sender" ? "sendmsg" : "recvmsg") << " request. rand number sent is " << r_;
+        unsigned char encrypted_r[1024];  // enough for an 8192-bit key
+        size_t encrypted_len = my::encrypt_nonce(presented.get(), r_, encrypted_r, sizeof(encrypted_r));
+        if (encrypted_len == 0) {
+            r_.clear();
+            finish("failed request", 403);
+            return false;
+        }
+        reply(my::TextView(reinterpret_cast<char*>(encrypted_r), encrypted_len));
+        return true;
+    }
 
-                std::string csr = "";
-                for (int i = 6; i < requestLines.size(); i ++) {
-                    csr += requestLines[i];
-                }
+    // The mutual TLS counterpart of challenge(): the client certificate was
+    // checked against the CA during the handshake, so all that is left is
+    // making sure it is still the one on file for its subject. Returns false
+    // after answering 403.
+    bool check_peer_certificate(const std::string& role)
+    {
+        if (peer_cert_ != nullptr) {
+            my::CertificateRef on_file = certs_.get(peer_user_);
+            if (on_file != nullptr && on_file->x509() != nullptr && X509_cmp(on_file->x509(), peer_cert_.get()) == 0) {
+                user_ = peer_user_;
+                my::log(my::LOG_INFO) << role << " " << user_ << " authenticated by its TLS certificate";
+                return true;
+            }
+        }
+        finish("fake-identity", 403);
+        return false;
+    }
 
-                std::string fields = "type=changepw&username=" + username + "&old_password=" + old_password + "&new_password=";
-                fields += new_password;
-                std::string body = fields + "\r\n" + csr;
-                // my::check_body(body); When sending cert, we do not add \r\n at the end.
-                request = "POST / HTTP/1.1\r\n";
-                request += "Host: duckduckgo.com\r\n";
-                request += "Content-Type: application/octet-stream\r\n";
-                request += "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
-
-                BIO_write(CAssl_bio.get(), request.data(), request.size());
-                BIO_flush(CAssl_bio.get());
-                std::string response = my::receive_http_message(CAssl_bio.get());
-                size_t pos = response.find("-----BEGIN CERTIFICATE-----");
-                if (pos != std::string::npos) {
-                    std::string certificate = response.substr(pos, response.size() - pos);
-                    my::write_user_certificate(paramMap["username"], certificate);
-                    my::send_http_response(bio.get(), certificate);
-                } else {
-                    my::send_http_response(bio.get(), "failed request", 403);
-                }
+    // The SHA-256 fingerprint of the certificate on file for username, or ""
+    // if there is none.
+    std::string certificate_fingerprint(const std::string& username)
+    {
+        my::CertificateRef cert = certs_.get(username);
+        return cert == nullptr ? "" : cert->fingerprint();
+    }
 
-            } else if (paramMap["type"].compare("sendmsg") == 0) {
-                std::cout << "sendmsg request. certificate get." << std::endl;
-                //check certificate
-                std::ofstream sender_cert("tmp/sender.cert.pem", std::ofstream::binary);
-                std::string cert_content;
-                for (int i = 6; i < requestLines.size(); i++) {
-                    cert_content += requestLines[i];
-                }
-                sender_cert << cert_content;
-                sender_cert.close();
+    // Checks a token from an earlier challenge. A bad or expired one leaves
+    // the conversation open, so the client can take the challenge instead.
+    bool check_token(const std::string& token, const std::string& role)
+    {
+        std::string user = my::AuthTokens::user_of(token);
+        if (!my::valid_username(user) || !tokens_.valid(token, certificate_fingerprint(user))) {
+            reply("bad-token", 403);
+            step_ = START;
+            return false;
+        }
+        user_ = user;
+        my::log(my::LOG_INFO) << role << " " << user_ << " authenticated by token";
+        return true;
+    }
 
-                if (exec("openssl verify -CAfile ca-chain.cert.pem tmp/sender.cert.pem") != "tmp/sender.cert.pem: OK") {
-                    std::cout << "Sender's certificate is not verified" << std::endl;
-                    my::send_http_response(bio.get(),"fake-identity", 403);
-                    clean();
-                    continue;
-                }
+    // Hands the client that just passed the challenge a token for its next
+    // conversations, in a header of the next response.
+    void issue_token()
+    {
+        std::string fingerprint = certificate_fingerprint(user_);
+        if (tokens_.enabled() && !fingerprint.empty()) {
+            token_header_ = "Token: " + tokens_.issue(user_, fingerprint) + "\r\n";
+        }
+    }
 
-                std::string subname = exec("openssl x509 -noout -subject -in tmp/sender.cert.pem");
-                std::string sender_name = subname.substr(subname.rfind(" ") + 1);
-                // check if sender cert exists
-                std::string sender_cert_path = "certs/"+sender_name+".cert.pem";
-                std::ifstream f_check_sender(sender_cert_path, std::ifstream::binary);
-                if(!f_check_sender || exec("cmp certs/" + sender_name + ".cert.pem tmp/sender.cert.pem") != "") {
-                    my::send_http_response(bio.get(),"fake-identity", 403);
-                    clean();
-                    continue;
-                }
+    void handle_sendmsg_number(const std::vector<my::TextView>& requestLines)
+    {
+        my::ArenaVector<my::TextView> para{my::ArenaAllocator<my::TextView>(&arena_)};
+        my::split(requestLines[5], " ", para);
+        my::TextView numReceived = para[0];
+        my::ArenaVector<my::TextView> recipients(para.begin() + 1, para.end(), my::ArenaAllocator<my::TextView>(&arena_));
+        my::log(my::LOG_INFO) << "sendmsg request. rand number receive is " << numReceived;
+        {
+            my::LogRecord line = my::log(my::LOG_INFO);
+            line << "recipients are:";
+            for (size_t i = 0; i < recipients.size(); i++) {
+                line << " " << recipients[i];
+            }
+        }
+        if (numReceived != r_) {
+            //std::cout << "Number does not match! Fake identity!!!" << std::endl;
+            finish("fake-identity", 403);
+            return;
+        }
+        else {
+            my::log(my::LOG_INFO) << "Number match! Identity confirmed!!!";
+        }
+        issue_token();
+        send_recipient_certificates(recipients);
+    }
 
-                std::string r = std::to_string(rand());  // need to be checked the same!
-                std::cout << "sendmsg request. rand number sent is " << r << std::endl;
-                std::ofstream f("tmp/num.temp", std::ofstream::binary);
-                f << r;
-                f.close();
-                //use sender's pubkey to encrypt the rand num
-                system("openssl x509 -pubkey -noout -in tmp/sender.cert.pem > tmp/sender.pubkey.pem");
-                system("openssl pkeyutl -encrypt -pubin -inkey tmp/sender.pubkey.pem -in tmp/num.temp -out tmp/encryp.temp");
-                std::ifstream encryptn("tmp/encryp.temp", std::ifstream::binary);
-                std::string encrypted_r((std::istreambuf_iterator<char>(encryptn)), std::istreambuf_iterator<char>());
-                encryptn.close();
-                my::send_http_response(bio.get(), encrypted_r);
-
-                // get number and recipient
-                //bio = my::accept_new_tcp_connection(accept_bio.get());
-                request = my::receive_http_message(bio.get());
-                printf("Got request:\n");           
-                std::vector<std::string> requestLines = splitStringBy(request, "\r\n");
-                std::vector<std::string> para = splitStringBy(requestLines[5], " ");
-                std::string numReceived = para[0];
-                std::vector<std::string> recipients;
-                for (int i = 1; i < para.size(); i++) {
-                    recipients.push_back(para[i]);
-                }
-                std::cout << "sendmsg request. rand number receive is " + numReceived << std::endl;
-                std::cout << "recipients are:";
-                for (int i = 0; i < recipients.size(); i++) {
-                    std::cout << " " + recipients[i];
-                }
-                std::cout << "\n";
-                if (numReceived != r) {
-                    //std::cout << "Number does not match! Fake identity!!!" << std::endl;
-                    my::send_http_response(bio.get(), "fake-identity", 403);
-                    clean();
-                    continue;
-                }
-                else {
-                    std::cout << "Number match! Identity confirmed!!!" << std::endl;
+    // Answers with each recipient followed by its certificate, or "no". The
+    // certificates are shared with the store, and copied once, into the
+    // response.
+    void send_recipient_certificates(const my::ArenaVector<my::TextView>& recipients)
+    {
+        my::ArenaVector<my::CertificateRef> certs{my::ArenaAllocator<my::CertificateRef>(&arena_)};
+        certs.reserve(recipients.size());
+        size_t body_size = 0;
+        int validRecipientCount = 0;
+        for (my::TextView recipient : recipients) {
+            certs.push_back(find_certificate(recipient.str()));
+            if (certs.back() != nullptr) {
+                recipients_.insert(recipient.str());
+            }
+            body_size += recipient.size + 2 + (certs.back() != nullptr ? certs.back()->pem().size() : 2) + 2;
+            validRecipientCount += certs.back() != nullptr;
+        }
+        // Each certificate goes out from the store rather than being copied
+        // in; only the names are, since the request they point into goes.
+        std::vector<my::TextView> body;
+        std::vector<std::shared_ptr<const void>> keep;
+        body.reserve(3 * recipients.size());
+        keep.reserve(recipients.size());
+        for (size_t i = 0; i < recipients.size(); i++) {
+            char *name = static_cast<char*>(arena_.allocate(recipients[i].size + 2, 1));
+            memcpy(name, recipients[i].data, recipients[i].size);
+            memcpy(name + recipients[i].size, "\r\n", 2);
+            body.emplace_back(name, recipients[i].size + 2);
+            if (certs[i] == nullptr) {
+                body.emplace_back("no");
+            } else {
+                body.emplace_back(certs[i]->pem());
+                keep.push_back(certs[i]);
+            }
+            body.emplace_back("\r\n");
+        }
+        output_.emplace_back(my::format_http_head(body_size, 200, token_header_, &arena_), std::move(body),
+                             std::move(keep));
+        token_header_.clear();
+
+        my::log(my::LOG_INFO) << "valid recipients: " << validRecipientCount;
+        remaining_recipients_ = validRecipientCount;
+        step_ = remaining_recipients_ > 0 ? SENDMSG_RECIPIENT : DONE;
+    }
+
+    // The certificate of username, from the store, or from the shard that
+    // owns the user. Null if there is none.
+    my::CertificateRef find_certificate(const std::string& username)
+    {
+        if (!my::valid_username(username)) {
+            return nullptr;
+        }
+        if (!cluster_.owns(username)) {
+            std::string cert;
+            if (!cluster_.request(username, "type=peercert&username=" + username, "", cert)) {
+                return nullptr;
+            }
+            return std::make_shared<const my::StoredCertificate>(std::move(cert));
+        }
+        return certs_.get(username);
+    }
+
+    void next_recipient()
+    {
+        step_ = --remaining_recipients_ > 0 ? SENDMSG_RECIPIENT : DONE;
+    }
+
+    void handle_sendmsg_key(const std::vector<my::TextView>& requestLines)
+    {
+        my::log(my::LOG_INFO) << "sendmsg request. key.bin.enc get ";//<< requestLines[5];
+        if (recipients_.count(curr_recipient_) == 0) {
+            reply("failed request", 403);
+            step_ = SENDMSG_SKIP_ID_MAIL;
+            return;
+        }
+        int count = count_message_number("messages/" + curr_recipient_);
+        if (count > 99999) {
+            my::log(my::LOG_WARN) << curr_recipient_ << "'s mailbox is full!";
+            reply("failed request", 403);
+            step_ = SENDMSG_SKIP_ID_MAIL;
+            return;
+        }
+        // Stage the message in the scratch directory and move it into the
+        // mailbox only once all three parts have arrived, so the mailbox lock
+        // is never held while waiting on the client.
+        staged_ = scratch_.path(curr_recipient_);
+        mkdir(staged_.c_str(), 0777);
+        std::ofstream msg1(staged_ + "/key.bin.enc", std::ofstream::binary);
+        msg1 << requestLines[5];
+        msg1.close();
+        reply("ok");
+        step_ = SENDMSG_ID_MAIL;
+    }
+
+    void handle_sendmsg_id_mail(const std::vector<my::TextView>& requestLines)
+    {
+        my::log(my::LOG_INFO) << "sendmsg request. id_mail.enc get ";//<< requestLines[5];
+        std::ofstream msg2(staged_ + "/id_mail.enc", std::ofstream::binary);
+        msg2 << requestLines[5];
+        msg2.close();
+        reply("ok");
+        step_ = SENDMSG_SIGNATURE;
+    }
+
+    void handle_sendmsg_signature(const std::vector<my::TextView>& requestLines)
+    {
+        my::log(my::LOG_INFO) << "sendmsg request. signature.sign get ";//<< requestLines[5];
+        std::ofstream msg3(staged_ + "/signature.sign", std::ofstream::binary);
+        msg3 << requestLines[5];
+        msg3.close();
+        deliver_staged();
+    }
+
+    // One framed request carries the recipient and all three parts of the
+    // message. By now spool() and spool_data() have written the parts to
+    // staged_ as they arrived.
+    void handle_sendmsg_message()
+    {
+        std::unique_ptr<my::FrameSpool> spool = std::move(spool_);
+        curr_recipient_ = spool->text("recipient");
+        my::log(my::LOG_INFO) << "sendmsg request. message for " << curr_recipient_ << " get";
+        // Only to a recipient the sender was given the certificate of, which
+        // also keeps the name from leading out of the mailboxes.
+        if (recipients_.count(curr_recipient_) == 0) {
+            reply("failed request", 403);
+            next_recipient();
+            return;
+        }
+        int count = count_message_number("messages/" + curr_recipient_);
+        if (count > 99999) {
+            my::log(my::LOG_WARN) << curr_recipient_ << "'s mailbox is full!";
+            reply("failed request", 403);
+            next_recipient();
+            return;
+        }
+        if (!spool->complete() || !spool->wrote("key.bin.enc")
+            || !spool->wrote("id_mail.enc") || !spool->wrote("signature.sign")) {
+            reply("failed request", 403);
+            next_recipient();
+            return;
+        }
+        deliver_staged();
+    }
+
+    void deliver_staged()
+    {
+        bool delivered = cluster_.owns(curr_recipient_) ? deliver_message(curr_recipient_, staged_)
+                                                         : forward_message(cluster_, curr_recipient_, staged_);
+        if (!delivered) {
+            my::log(my::LOG_WARN) << "could not deliver to " << curr_recipient_;
+            reply("failed request", 403);
+        } else {
+            reply("ok");
+        }
+        next_recipient();
+    }
+
+    void handle_recvmsg_number(const std::vector<my::TextView>& requestLines)
+    {
+        my::log(my::LOG_INFO) << "recvmsg request. rand number receive is " << requestLines[5];
+        if (requestLines[5] != r_) {
+            //std::cout << "Number does not match! Fake identity!!!" << std::endl;
+            finish("fake-identity", 403);
+            return;
+        }
+        else {
+            my::log(my::LOG_INFO) << "Number match! Identity confirmed!!!";
+        }
+        issue_token();
+        send_newest_message();
+    }
+
+    void send_newest_message()
+    {
+        step_ = DONE;
+
+        auto mailbox_lock = my::lock_mailbox(user_);
+        int count = count_message_number("messages/" + user_);
+        if (count == -1) {
+            mkdir(("messages/" + user_).c_str(), 0777);
+            count = 0;
+        } // count cannot exceed 99999
+
+        if (count == 0 && !mail_watch_.stopped() && std::chrono::steady_clock::now() < wait_until_) {
+            // Nothing yet: the front end parks the conversation until mail
+            // arrives or the wait is over, then calls this again.
+            step_ = RECVMSG_WAIT;
+        }
+        else if (count == 0) {
+            reply("your-mailbox-is-empty", 403);
+        }
+        else {
+            std::string s_count = std::to_string(count - 1);
+            std::string file_prefix = "messages/" + user_ + "/" + std::string(5 - s_count.length(), '0') + s_count + "/";
+
+            reply_file(file_prefix + "key.bin.enc");
+            reply_file(file_prefix + "id_mail.enc");
+            reply_file(file_prefix + "signature.sign");
+
+            // The responses hold the files open, so they can go already.
+            my::remove_tree(file_prefix);
+        }
+    }
+
+    // Requests from the other shards of the cluster carry the cluster
+    // secret and are only for users this shard owns. Answers 403 otherwise.
+    bool check_peer(my::TextView secret, const std::string& username)
+    {
+        if (!cluster_.authentic(secret.str()) || !my::valid_username(username) || !cluster_.owns(username)) {
+            reply("failed request", 403);
+            return false;
+        }
+        return true;
+    }
+
+    // What another shard sent after the parameters line, as it was sent.
+    static std::string peer_payload(const std::vector<my::TextView>& requestLines)
+    {
+        std::string payload;
+        for (size_t i = 6; i < requestLines.size(); i++) {
+            payload += i > 6 ? "\r\n" : "";
+            payload.append(requestLines[i].data, requestLines[i].size);
+        }
+        return payload;
+    }
+
+    // Another shard looks up the certificate of a user this shard owns.
+    void handle_peercert(const my::PeerCertRequest& peer, const std::vector<my::TextView>&)
+    {
+        std::string username = peer.username.str();
+        if (!check_peer(peer.secret, username)) {
+            return;
+        }
+        if (my::CertificateRef cert = find_certificate(username)) {
+            reply(cert->pem());
+        } else {
+            reply("no", 403);
+        }
+    }
+
+    // This shard takes over a user's certificate while the cluster is rebalanced.
+    void handle_peerputcert(const my::PeerCertRequest& peer, const std::vector<my::TextView>& requestLines)
+    {
+        std::string username = peer.username.str();
+        if (!check_peer(peer.secret, username)) {
+            return;
+        }
+        auto mailbox_lock = my::lock_mailbox(username);
+        std::string certificate = peer_payload(requestLines);
+        my::write_user_certificate(username, certificate);
+        certs_.put(username, certificate);
+        reply("ok");
+    }
+
+    // Another shard delivers a message to a user this shard owns.
+    void handle_peerdeliver(const my::PeerDeliverRequest& peer, const std::vector<my::TextView>& requestLines)
+    {
+        std::string username = peer.username.str();
+        if (!check_peer(peer.secret, username)) {
+            return;
+        }
+        std::string payload = peer_payload(requestLines);
+        std::string dir = scratch_.path(username);
+        mkdir(dir.c_str(), 0777);
+        const char *parts[] = {"key.bin.enc", "id_mail.enc", "signature.sign"};
+        size_t offset = 0;
+        for (int i = 0; i < 3; i++) {
+            size_t size = std::stoul(peer.part_sizes[i].str());
+            std::ofstream f(dir + "/" + parts[i], std::ofstream::binary);
+            f << payload.substr(offset, size);
+            offset += size;
+        }
+        if (offset == payload.size() && deliver_message(username, dir)) {
+            reply("ok");
+        } else {
+            my::log(my::LOG_WARN) << "could not deliver to " << username;
+            reply("failed request", 403);
+        }
+    }
+
+    void handle_sendmsg(const my::SendMsgRequest& sendmsg, const std::vector<my::TextView>& requestLines)
+    {
+        if (sendmsg.auth.empty()) {
+            my::log(my::LOG_INFO) << "sendmsg request. certificate get.";
+            if (challenge(requestLines, "sender")) {
+                step_ = SENDMSG_NUMBER;
+            }
+            return;
+        }
+        // The recipients come along with the first request.
+        if (sendmsg.auth == "tls" ? check_peer_certificate("sender") : check_token(sendmsg.token.str(), "sender")) {
+            my::ArenaVector<my::TextView> names{my::ArenaAllocator<my::TextView>(&arena_)};
+            my::split(requestLines.size() > 6 ? requestLines[6] : my::TextView(), " ", names);
+            my::ArenaVector<my::TextView> recipients{my::ArenaAllocator<my::TextView>(&arena_)};
+            for (my::TextView name : names) {
+                if (!name.empty()) {
+                    recipients.push_back(name);
                 }
+            }
+            send_recipient_certificates(recipients);
+        }
+    }
 
-                // send recipient certificate
-                std::vector<std::string> certificates;
-                std::string noCert("no");
-                int validRecipientCount = 0;
-                for (int i = 0; i < recipients.size(); i ++) {
-                    std::string recipient_cert_path = "certs/" + recipients[i] + ".cert.pem";
-                    std::ifstream f2(recipient_cert_path, std::ifstream::binary);
-                    if (!f2) {
-                        certificates.push_back(noCert);
-                    } else {
-                        std::string cert((std::istreambuf_iterator<char>(f2)), std::istreambuf_iterator<char>());
-                        certificates.push_back(cert);
-                        f2.close();
-                        validRecipientCount ++;
-                    }
+    void handle_recvmsg(const my::RecvMsgRequest& recvmsg, const std::vector<my::TextView>& requestLines)
+    {
+        wait_until_ = mail_watch_.deadline(atoi(recvmsg.wait.str().c_str()));
+        if (recvmsg.auth.empty()) {
+            my::log(my::LOG_INFO) << "recvmsg request. certificate get.";
+            if (challenge(requestLines, "recipient")) {
+                step_ = RECVMSG_NUMBER;
+            }
+            return;
+        }
+        if (recvmsg.auth == "tls" ? check_peer_certificate("recipient") : check_token(recvmsg.token.str(), "recipient")) {
+            send_newest_message();
+        }
+    }
+
+    // Reads the parameters handler takes into its request struct and calls
+    // it, or refuses the request if one it needs is missing.
+    template<class Request>
+    void dispatch(void (Session::*handler)(const Request&, const std::vector<my::TextView>&),
+                  const my::FormParams& paramMap, const std::vector<my::TextView>& requestLines)
+    {
+        Request request;
+        if (!my::parse_request(paramMap, request)) {
+            reply("failed request", 403);
+            return;
+        }
+        (this->*handler)(request, requestLines);
+    }
+
+    void handle_first_request(const std::vector<my::TextView>& requestLines)
+    {
+        my::FormParams paramMap(requestLines.size() > 5 ? requestLines[5] : my::TextView());
+
+        step_ = DONE;
+        switch (my::request_type_of(paramMap["type"])) {
+        case my::RequestType::GETCERT:
+            dispatch(&Session::handle_getcert, paramMap, requestLines);
+            break;
+        case my::RequestType::CHANGEPW:
+            dispatch(&Session::handle_changepw, paramMap, requestLines);
+            break;
+        case my::RequestType::SENDMSG:
+            dispatch(&Session::handle_sendmsg, paramMap, requestLines);
+            break;
+        case my::RequestType::RECVMSG:
+            dispatch(&Session::handle_recvmsg, paramMap, requestLines);
+            break;
+        case my::RequestType::PEERCERT:
+            dispatch(&Session::handle_peercert, paramMap, requestLines);
+            break;
+        case my::RequestType::PEERPUTCERT:
+            dispatch(&Session::handle_peerputcert, paramMap, requestLines);
+            break;
+        case my::RequestType::PEERDELIVER:
+            dispatch(&Session::handle_peerdeliver, paramMap, requestLines);
+            break;
+        case my::RequestType::UNKNOWN:
+            reply("failed request", 403);
+            break;
+        }
+    }
+
+public:
+    explicit Session(Services& services, const std::string& source)
+        : ca_pool_(services.ca_pool), cluster_(services.cluster), admission_(services.admission),
+          tokens_(services.tokens), mail_watch_(services.mail_watch),
+          verifier_(services.verifier), certs_(services.certs), source_(source),
+          max_body_size_(services.max_body_size) {}
+
+    ~Session()
+    {
+        if (admitted_) {
+            admission_.leave();
+        }
+    }
+
+    // Keeps the client certificate if the handshake verified one; see
+    // client_auth in main().
+    void on_handshake(SSL *ssl) override
+    {
+        my::UniquePtr<X509> cert(SSL_get_peer_certificate(ssl));
+        char name[256];
+        if (cert != nullptr && SSL_get_verify_result(ssl) == X509_V_OK
+            && X509_NAME_get_text_by_NID(X509_get_subject_name(cert.get()), NID_commonName, name, sizeof(name)) >= 0) {
+            peer_cert_ = std::move(cert);
+            peer_user_ = name;
+        }
+    }
+
+    size_t max_body_size() const override { return max_body_size_; }
+
+    // A message frame, the only kind there is, is written straight into the
+    // staging directory, so a large message never sits in memory.
+    bool spool(size_t /*frame_size*/) override
+    {
+        if (step_ != SENDMSG_RECIPIENT) {
+            return false;
+        }
+        staged_ = scratch_.path("spooled");
+        mkdir(staged_.c_str(), 0777);
+        spool_.reset(new my::FrameSpool(staged_, {"key.bin.enc", "id_mail.enc", "signature.sign"}));
+        return true;
+    }
+
+    void spool_data(const char *data, size_t size) override
+    {
+        spool_->feed(data, size);
+    }
+
+    std::vector<my::Response> on_message(const std::string& request) override
+    {
+        // Whatever the last request built, its responses included, has been
+        // sent by now: the front ends read the next request only after that.
+        arena_.release();
+        my::log(my::LOG_DEBUG) << "Got request";
+        // handle request based on type. A first request can carry a
+        // password or a token, so only the later ones are logged whole.
+        if (step_ != START) {
+            my::log(my::LOG_TRACE).payload("request", request);
+        }
+        // Frames are only used for the parts of a message; they are never
+        // split into lines.
+        bool framed = my::is_frame(request.data(), request.size());
+        if (framed && (step_ != SENDMSG_RECIPIENT || spool_ == nullptr)) {
+            finish("failed request", 403);
+        }
+        // Views into request; request_lines_ only keeps its storage between requests.
+        std::vector<my::TextView>& requestLines = request_lines_;
+        requestLines.clear();
+        if (!framed) {
+            my::split(request, "\r\n", requestLines);
+            // Every request after the first carries its payload on line 5.
+            if (step_ != START && requestLines.size() <= 5) {
+                finish("failed request", 403);
+            }
+        }
+        switch (step_) {
+        case START:
+            handle_first_request(requestLines);
+            break;
+        case SENDMSG_NUMBER:
+            handle_sendmsg_number(requestLines);
+            break;
+        case SENDMSG_RECIPIENT:
+            if (framed) {
+                handle_sendmsg_message();
+                break;
+            }
+            curr_recipient_ = requestLines[5].str();
+            reply("ok");
+            my::log(my::LOG_INFO) << "processing " << curr_recipient_;
+            step_ = SENDMSG_KEY;
+            break;
+        case SENDMSG_KEY:
+            handle_sendmsg_key(requestLines);
+            break;
+        case SENDMSG_ID_MAIL:
+            handle_sendmsg_id_mail(requestLines);
+            break;
+        case SENDMSG_SIGNATURE:
+            handle_sendmsg_signature(requestLines);
+            break;
+        case SENDMSG_SKIP_ID_MAIL:
+            reply("failed request", 403);
+            step_ = SENDMSG_SKIP_SIGNATURE;
+            break;
+        case SENDMSG_SKIP_SIGNATURE:
+            reply("failed request", 403);
+            next_recipient();
+            break;
+        case RECVMSG_NUMBER:
+            handle_recvmsg_number(requestLines);
+            break;
+        case RECVMSG_WAIT:
+            // The client sends nothing while it waits for mail.
+            finish("failed request", 403);
+            break;
+        case DONE:
+            break;
+        }
+        std::vector<my::Response> output;
+        output.swap(output_);
+        return output;
+    }
+
+    bool done() const override { return step_ == DONE; }
+
+    bool ca_bound(const std::string& request) const override
+    {
+        if (step_ != START) {
+            return false;
+        }
+        my::RequestType type = my::request_type_of(request_type(request));
+        return type == my::RequestType::GETCERT || type == my::RequestType::CHANGEPW;
+    }
+
+    // Only the first request of a conversation is checked. Requests from
+    // other shards were admitted where the conversation started; they are
+    // authenticated by the cluster secret instead.
+    bool admit(const std::string& request) override
+    {
+        if (step_ != START || admitted_ || my::is_peer_request(my::request_type_of(request_type(request)))) {
+            return true;
+        }
+        bool authenticated = peer_cert_ != nullptr;
+        admitted_ = admission_.enter(source_, authenticated ? peer_user_ : request_owner(request), authenticated);
+        return admitted_;
+    }
+
+    bool waiting() const override { return step_ == RECVMSG_WAIT; }
+
+    // Mail may have arrived between the last look and the watch being set
+    // up; then the watcher wakes the conversation straight away.
+    void park(std::function<void()> wake) override
+    {
+        mail_watch_.watch(user_, wait_until_, wake);
+        if (count_message_number("messages/" + user_) > 0) {
+            mail_watch_.wake_up(user_);
+        }
+    }
+
+    std::vector<my::Response> resume() override
+    {
+        send_newest_message();
+        std::vector<my::Response> output;
+        output.swap(output_);
+        return output;
+    }
+
+    std::vector<my::Response> busy() override
+    {
+        finish("server-busy-retry-later", 503);
+        std::vector<my::Response> output;
+        output.swap(output_);
+        return output;
+    }
+};
+
+void write_responses(BIO *bio, std::vector<my::Response> responses)
+{
+    for (my::Response& response : responses) {
+        while (!response.sent()) {
+            if (my::send_response_part(my::get_ssl(bio), response) <= 0) {
+                my::print_errors_and_throw("error sending response");
+            }
+        }
+    }
+}
+
+// Runs a conversation on the calling worker. A request that waits on CAserver
+// moves the connection over to the CA lane, so this worker goes straight back
+// to mailbox requests; request carries the already-read message across. A
+// conversation waiting for mail holds no worker: it is picked up again on
+// the pool, with resumed set, once it is woken.
+void handle_connection(std::shared_ptr<BIO> bio, std::shared_ptr<Session> session, Services& services,
+                       my::WorkerPool& pool, my::WorkerPool *ca_lane,
+                       std::string request = std::string(), bool resumed = false)
+{
+    try {
+        if (session == nullptr) {
+            session = std::make_shared<Session>(services, my::peer_address(BIO_get_fd(bio.get(), nullptr)));
+            if (BIO_do_handshake(bio.get()) <= 0) {
+                my::print_errors_and_throw("Error in BIO_do_handshake");
+            }
+            session->on_handshake(my::get_ssl(bio.get()));
+        }
+        while (!session->done()) {
+            if (resumed) {
+                write_responses(bio.get(), session->resume());
+                resumed = false;
+            } else {
+                if (request.empty()) {
+                    request = my::receive_request(bio.get(), session->max_body_size(), session.get());
                 }
-                std::string certResponse;
-                for (int i = 0; i < recipients.size(); i ++) {
-                    certResponse += recipients[i] + "\r\n";
-                    certResponse += certificates[i] + "\r\n";
+                if (!session->admit(request)) {
+                    write_responses(bio.get(), session->busy());
+                    return;
                 }
-                my::send_http_response(bio.get(), certResponse);
-
-                std::cout << "valid recipients: " << validRecipientCount << std::endl;
-
-                for (int i = 0; i < validRecipientCount; i ++) {
-
-                    request = my::receive_http_message(bio.get());
-                    printf("Got request:\n");
-                    requestLines = splitStringBy(request, "\r\n");
-                    std::string currRecipient = requestLines[5];
-                    my::send_http_response(bio.get(), "ok");
-
-                    std::cout << "processing " << currRecipient << std::endl;
-
-                    request = my::receive_http_message(bio.get());
-                    printf("Got request:\n");
-                    requestLines = splitStringBy(request, "\r\n");
-                    std::cout << "sendmsg request. key.bin.enc get " << std::endl;//<< requestLines[5];
-                    int count = count_message_number("messages/" + currRecipient);
-                    if (count > 99999) {
-                        std::cerr << currRecipient << "'s mailbox is full!" << std::endl;
-                        my::send_http_response(bio.get(), "failed request", 403);
-                        request = my::receive_http_message(bio.get());
-                        my::send_http_response(bio.get(), "failed request", 403);
-                        request = my::receive_http_message(bio.get());
-                        my::send_http_response(bio.get(), "failed request", 403);
-                    } else {
-                        my::send_http_response(bio.get(), "ok");
-                        if (count == -1) {
-                            system(("mkdir messages/" + currRecipient).c_str());
-                            count = 0;
-                        }
-
-                        std::string s_count = std::to_string(count);
-                        std::string file_prefix =
-                                "messages/" + currRecipient + "/" + std::string(5 - s_count.length(), '0') + s_count + "/";
-                        system(("mkdir " + file_prefix).c_str());
-                        std::ofstream msg1(file_prefix + "key.bin.enc", std::ofstream::binary);
-                        msg1 << requestLines[5];
-                        msg1.close();
-                        my::send_http_response(bio.get(), "ok");
-
-                        request = my::receive_http_message(bio.get());
-                        printf("Got request:\n");
-                        requestLines = splitStringBy(request, "\r\n");
-                        std::cout << "sendmsg request. id_mail.enc get " << std::endl;//<< requestLines[5];
-                        std::ofstream msg2(file_prefix + "id_mail.enc", std::ofstream::binary);
-                        msg2 << requestLines[5];
-                        msg2.close();
-                        my::send_http_response(bio.get(), "ok");
-
-                        request = my::receive_http_message(bio.get());
-                        printf("Got request:\n");
-                        requestLines = splitStringBy(request, "\r\n");
-                        std::cout << "sendmsg request. signature.sign get " << std::endl;//<< requestLines[5];
-                        std::ofstream msg3(file_prefix + "signature.sign", std::ofstream::binary);
-                        msg3 << requestLines[5];
-                        msg3.close();
-                        my::send_http_response(bio.get(), "ok");
-                        clean();
+                if (ca_lane != nullptr && session->ca_bound(request)) {
+                    bool queued = ca_lane->try_submit([bio, session, &services, &pool, request] {
+                        handle_connection(bio, session, services, pool, nullptr, request);
+                    });
+                    if (!queued) {
+                        write_responses(bio.get(), session->busy());
                     }
+                    return;
                 }
+                write_responses(bio.get(), session->on_message(request));
+                request.clear();
+            }
+            if (session->waiting()) {
+                // The wake-up runs on the mail watcher, which must not block.
+                session->park([bio, session, &services, &pool] {
+                    pool.post([bio, session, &services, &pool] {
+                        handle_connection(bio, session, services, pool, nullptr, std::string(), true);
+                    });
+                });
+                return;
+            }
+        }
+    } catch (const std::exception& ex) {
+        my::log(my::LOG_ERROR) << "Worker exited with exception: " << ex.what();
+    }
+}
 
-            } else if (paramMap["type"].compare("recvmsg") == 0) {
-                std::cout << "recvmsg request. certificate get." << std::endl;
-                //check certificate
-                std::ofstream recipient_cert("tmp/recipient.cert.pem", std::ofstream::binary);
-                std::string cert_content;
-                for (int i = 6; i < requestLines.size(); i++) {
-                    cert_content += requestLines[i];
-                }
-                recipient_cert << cert_content;
-                recipient_cert.close();
-
-                if (exec("openssl verify -CAfile ca-chain.cert.pem tmp/recipient.cert.pem") != "tmp/recipient.cert.pem: OK") {
-                    std::cout << "Recipient's certificate is not verified" << std::endl;
-                    my::send_http_response(bio.get(),"fake-identity", 403);
-                    clean();
-                    continue;
-                }
-                //check if same as exist file
-                std::string subname = exec("openssl x509 -noout -subject -in tmp/recipient.cert.pem");
-                std::string recipient_name = subname.substr(subname.rfind(" ") + 1);
-                std::string recipient_cert_path = "certs/"+recipient_name+".cert.pem";
-                std::ifstream f_check_recipient(recipient_cert_path, std::ifstream::binary);
-                if(!f_check_recipient || exec("cmp certs/" + recipient_name + ".cert.pem tmp/recipient.cert.pem") != "") {
-                    my::send_http_response(bio.get(),"fake-identity", 403);
-                    clean();
-                    continue;
-                }
-                
-                std::string r = std::to_string(rand());  // need to be checked the same!
-                std::cout << "recvmsg request. rand number sent is " << r << std::endl;
-
-                std::ofstream f("tmp/num.temp", std::ofstream::binary);
-                f << r;
-                f.close();
-                //use recipient's pubkey 
-                system("openssl x509 -pubkey -noout -in tmp/recipient.cert.pem > tmp/recipient.pubkey.pem");
-                system("openssl pkeyutl -encrypt -pubin -inkey tmp/recipient.pubkey.pem -in tmp/num.temp -out tmp/encryp.temp");
-                std::ifstream encryptn("tmp/encryp.temp", std::ifstream::binary);
-                std::string encrypted_r((std::istreambuf_iterator<char>(encryptn)), std::istreambuf_iterator<char>());
-                encryptn.close();
-                my::send_http_response(bio.get(), encrypted_r);
-
-                // get number
-                request = my::receive_http_message(bio.get()); //number
-                printf("Got request:\n");           
-                std::vector<std::string> requestLines = splitStringBy(request, "\r\n");
-                std::cout << "recvmsg request. rand number receive is " << requestLines[5] << std::endl;
-                if (requestLines[5] != r) {
-                    //std::cout << "Number does not match! Fake identity!!!" << std::endl;
-                    my::send_http_response(bio.get(),"fake-identity", 403);
-                    clean();
+// Copies TLS records between the client and its shard until either side
+// closes. Each record read is written on as one record, so the clients still
+// see one response per record.
+void relay(BIO *client, BIO *shard)
+{
+    BIO *from[2] = {client, shard};
+    BIO *to[2] = {shard, client};
+    struct pollfd fds[2] = {};
+    for (int i = 0; i < 2; i++) {
+        fds[i].fd = BIO_get_fd(from[i], nullptr);
+        fds[i].events = POLLIN;
+        // Report a record without application data (e.g. a session ticket)
+        // instead of blocking for the next one.
+        SSL_clear_mode(my::get_ssl(from[i]), SSL_MODE_AUTO_RETRY);
+    }
+    char buffer[16384];
+    while (true) {
+        if (BIO_pending(client) == 0 && BIO_pending(shard) == 0) {
+            if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+                return;
+            }
+        }
+        for (int i = 0; i < 2; i++) {
+            if (BIO_pending(from[i]) == 0 && fds[i].revents == 0) {
+                continue;
+            }
+            fds[i].revents = 0;
+            int len = BIO_read(from[i], buffer, sizeof(buffer));
+            if (len <= 0) {
+                if (BIO_should_retry(from[i])) {
                     continue;
                 }
-                else {
-                    std::cout << "Number match! Identity confirmed!!!" << std::endl;
+                ERR_clear_error();
+                return;
+            }
+            if (BIO_write(to[i], buffer, len) != len || BIO_flush(to[i]) <= 0) {
+                ERR_clear_error();
+                return;
+            }
+        }
+    }
+}
+
+// Router front end: reads the client's first request, connects to the shard
+// that owns the user it is for, and relays the rest of the conversation.
+void route_connection(std::shared_ptr<BIO> bio, my::Cluster& cluster, my::AdmissionControl& admission,
+                      size_t max_body_size)
+{
+    bool admitted = false;
+    try {
+        std::string request = my::receive_request(bio.get(), max_body_size);
+        std::string username = request_owner(request);
+        admitted = admission.enter(my::peer_address(BIO_get_fd(bio.get(), nullptr)), username, false);
+        if (!admitted) {
+            my::send_http_response(bio.get(), "server-busy-retry-later", 503);
+            return;
+        }
+        my::log(my::LOG_INFO) << "routing " << request_type(request) << " for " << username
+                              << " to shard " << cluster.shards().owner(username);
+        auto shard = cluster.connect_to_owner(username);
+        if (BIO_write(shard.get(), request.data(), request.size()) <= 0 || BIO_flush(shard.get()) <= 0) {
+            my::print_errors_and_throw("error in BIO_write");
+        }
+        relay(bio.get(), shard.get());
+    } catch (const std::exception& ex) {
+        my::log(my::LOG_ERROR) << "Worker exited with exception: " << ex.what();
+    }
+    if (admitted) {
+        admission.leave();
+    }
+}
+
+// Serves connections on listen_fd until SIGINT. Everything that holds sockets
+// or threads (the CA connections, the worker pools) is created here, so each
+// worker process of a prefork server builds its own after fork().
+void serve(SSL_CTX *ctx, const my::AuthTokens& tokens, int listen_fd, std::map<std::string, std::string>& configMap)
+{
+    static int socket_to_close = listen_fd;
+    signal(SIGINT, [](int) {
+        // Both the terminal and the prefork parent may deliver SIGINT, and
+        // the descriptor must only be closed once.
+        if (socket_to_close >= 0) {
+            close(socket_to_close);
+            socket_to_close = -1;
+        }
+    });
+    // A write to a connection the peer has closed must fail, not kill the server.
+    signal(SIGPIPE, SIG_IGN);
+
+    std::string server_mode = configMap.count("server_mode") ? configMap["server_mode"] : "threads";
+    my::Cluster cluster(configMap);
+    if (cluster.shards().clustered() && server_mode != "router" && !cluster.shards().listed()) {
+        fprintf(stderr, "shard_id must name one of the shard_ entries\n");
+        exit(1);
+    }
+    std::string CAserver_url = configMap["CAserver_ip"] + ":" + configMap["CAserver_port"];
+    my::TLSConnectionPool ca_pool(CAserver_url, configMap.count("ca_pool_size") ? std::stoi(configMap["ca_pool_size"]) : 2);
+    if (server_mode != "router") {
+        ca_pool.warm();
+    }
+
+    int worker_threads = configMap.count("worker_threads") ? std::stoi(configMap["worker_threads"])
+                                                            : std::thread::hardware_concurrency();
+    int worker_queue = configMap.count("worker_queue") ? std::stoi(configMap["worker_queue"]) : 0;
+    int ca_lane_threads = configMap.count("ca_lane_threads") ? std::stoi(configMap["ca_lane_threads"]) : 2;
+    int ca_lane_queue = configMap.count("ca_lane_queue") ? std::stoi(configMap["ca_lane_queue"]) : 64;
+    auto config_number = [&configMap](const std::string& key, double fallback) {
+        return configMap.count(key) ? std::stod(configMap[key]) : fallback;
+    };
+    my::AdmissionControl admission(config_number("max_in_flight", 0),
+                                   config_number("source_rate", 0), config_number("source_burst", 10),
+                                   config_number("user_rate", 0), config_number("user_burst", 5));
+
+    // recvmsg with wait=N parks until mail comes in, for at most max_wait seconds.
+    my::MailWatch mail_watch(configMap.count("max_wait") ? std::stoi(configMap["max_wait"]) : 60);
+    // Requests are refused once their body is larger than max_body_size bytes.
+    size_t max_body_size = configMap.count("max_body_size") ? std::stoull(configMap["max_body_size"]) : 64 << 20;
+    // Certificates presented for the challenge are checked against ca-chain.cert.pem,
+    // and up to cert_cache_size that passed are remembered until they expire.
+    my::CertVerifier verifier("ca-chain.cert.pem", configMap.count("cert_cache_size")
+                                                   ? std::stoul(configMap["cert_cache_size"]) : 1024);
+    // For each user taking challenges, up to challenge_queue_depth of them
+    // are encrypted ahead of time while the server is idle; 0 turns it off.
+    my::ChallengeQueue::instance().start(configMap.count("challenge_queue_depth")
+                                         ? std::stoul(configMap["challenge_queue_depth"]) : 4);
+    // The certificates in certs/ are kept in memory, read by one thread per core.
+    my::CertStore certs;
+    if (server_mode != "router") {
+        certs.preload(std::thread::hardware_concurrency());
+        my::log(my::LOG_INFO) << "certificates loaded: " << certs.size();
+    }
+    Services services{ca_pool, cluster, admission, tokens, mail_watch, verifier, certs, max_body_size};
+
+    // The general pool hands work to the CA lane, so it must stop first.
+    my::WorkerPool ca_lane(ca_lane_threads, ca_lane_queue);
+    my::WorkerPool pool(worker_threads, worker_queue);
+    if (server_mode == "reactor") {
+        static my::Reactor *running_reactor = nullptr;
+        my::Reactor reactor(ctx, listen_fd, pool, ca_lane, [&services](const std::string& source) {
+            return std::unique_ptr<my::Conversation>(new Session(services, source));
+        });
+        static my::MailWatch *running_mail_watch = nullptr;
+        running_reactor = &reactor;
+        running_mail_watch = &mail_watch;
+        signal(SIGINT, [](int) {
+            // Parked conversations are woken so the reactor can finish them.
+            running_mail_watch->stop();
+            running_reactor->stop();
+        });
+        reactor.run();
+        close(listen_fd);
+    } else {
+        while (auto bio = my::accept_new_tcp_connection(listen_fd)) {
+            bio = std::move(bio)
+                | my::UniquePtr<BIO>(BIO_new_ssl(ctx, 0))
+                ;
+            // std::function must be copyable, so the BIO travels as a shared_ptr.
+            std::shared_ptr<BIO> conn(bio.release(), BIO_free_all);
+            if (server_mode == "router") {
+                pool.submit([conn, &cluster, &admission, max_body_size] {
+                    route_connection(conn, cluster, admission, max_body_size);
+                });
+            } else {
+                pool.submit([conn, &services, &pool, &ca_lane] {
+                    handle_connection(conn, nullptr, services, pool, &ca_lane);
+                });
+            }
+        }
+        // Wakes the parked conversations while the pool can still finish them.
+        mail_watch.shutdown();
+    }
+}
+
+// Forks the worker processes of a prefork server and waits for them. Each
+// one binds server_port with SO_REUSEPORT and serves on its own; with
+// cpu_affinity set, worker i is pinned to the i-th CPU this process may use.
+// SIGINT is passed on to the workers, and a worker that crashes is replaced.
+void run_worker_processes(SSL_CTX *ctx, const my::AuthTokens& tokens, std::map<std::string, std::string>& configMap,
+                          int worker_processes, bool cpu_affinity)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus.push_back(cpu);
+        }
+    }
+
+    static std::vector<pid_t> workers;
+    static volatile sig_atomic_t stopping = 0;
+    workers.assign(worker_processes, 0);
+    signal(SIGINT, [](int) {
+        stopping = 1;
+        for (pid_t pid : workers) {
+            if (pid > 0) {
+                kill(pid, SIGINT);
+            }
+        }
+    });
+
+    auto start_worker = [&](int i) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("Error in fork");
+            return;
+        }
+        if (pid == 0) {
+            if (cpu_affinity && !cpus.empty()) {
+                cpu_set_t cpu;
+                CPU_ZERO(&cpu);
+                CPU_SET(cpus[i % cpus.size()], &cpu);
+                if (sched_setaffinity(0, sizeof(cpu), &cpu) != 0) {
+                    perror("Error in sched_setaffinity");
                 }
+            }
+            serve(ctx, tokens, my::open_listen_socket(configMap["server_port"], true), configMap);
+            exit(0);
+        }
+        workers[i] = pid;
+    };
+    for (int i = 0; i < worker_processes; i++) {
+        start_worker(i);
+    }
 
-                // TODO send recipient msg: if no, send no, continue
-                int count = count_message_number("messages/" + recipient_name);
-                if (count == -1) {
-                    system(("mkdir messages/" + recipient_name).c_str());
-                    count = 0;
-                } // count cannot exceed 99999
+    int remaining = worker_processes;
+    while (remaining > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < worker_processes; i++) {
+            if (workers[i] != pid) {
+                continue;
+            }
+            workers[i] = 0;
+            if (!stopping && WIFSIGNALED(status)) {
+                my::log(my::LOG_WARN) << "Worker process " << pid << " died from signal " << WTERMSIG(status) << ", restarting";
+                start_worker(i);
+            }
+            if (workers[i] == 0) {
+                remaining--;
+            }
+        }
+    }
+}
 
-                if (count == 0) {
-                    my::send_http_response(bio.get(), "your-mailbox-is-empty", 403);
+// "./server rebalance": hands the certificates and mail of every user this
+// shard no longer owns to the shard that does, after shard_ entries have been
+// added to or removed from config. Run it in each old shard's directory once
+// the cluster has been restarted with the new config; it can run while the
+// shard is serving and can be run again if a shard was unreachable.
+int rebalance(std::map<std::string, std::string>& configMap)
+{
+    signal(SIGPIPE, SIG_IGN);
+    my::Cluster cluster(configMap);
+    if (!cluster.shards().clustered()) {
+        fprintf(stderr, "There are no shard_ entries in config\n");
+        return 1;
+    }
+    std::set<std::string> users;
+    for (const char *dir : {"certs", "messages"}) {
+        DIR* dirp = opendir(dir);
+        struct dirent *entry;
+        while (dirp && (entry = readdir(dirp)) != nullptr) {
+            std::string name = entry->d_name;
+            if (name[0] == '.') {
+                continue;
+            }
+            size_t suffix = name.find(".cert.pem");
+            users.insert(suffix == std::string::npos ? name : name.substr(0, suffix));
+        }
+        if (dirp) {
+            closedir(dirp);
+        }
+    }
+
+    int failures = 0;
+    for (const std::string& username : users) {
+        if (cluster.owns(username)) {
+            continue;
+        }
+        std::string owner = cluster.shards().owner(username);
+        auto mailbox_lock = my::lock_mailbox(username);
+        try {
+            std::string cert_path = "certs/" + username + ".cert.pem";
+            std::ifstream f(cert_path, std::ifstream::binary);
+            bool moved_cert = static_cast<bool>(f);
+            if (moved_cert) {
+                std::string cert((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+                std::string response;
+                if (!cluster.request(username, "type=peerputcert&username=" + username, cert, response)) {
+                    throw std::runtime_error("shard " + owner + " refused the certificate");
                 }
-                else {
-                    std::string s_count = std::to_string(count - 1);
-                    std::string file_prefix = "messages/" + recipient_name + "/" + std::string(5 - s_count.length(), '0') + s_count + "/";
-
-                    std::ifstream f1(file_prefix + "key.bin.enc", std::ifstream::binary);
-                    std::string kbe((std::istreambuf_iterator<char>(f1)), std::istreambuf_iterator<char>());
-                    f1.close();
-                    my::send_http_response(bio.get(), kbe);
-
-                    std::ifstream f2(file_prefix + "id_mail.enc", std::ifstream::binary);
-                    std::string ime((std::istreambuf_iterator<char>(f2)), std::istreambuf_iterator<char>());
-                    f2.close();
-                    my::send_http_response(bio.get(), ime);
-
-                    std::ifstream f3(file_prefix + "signature.sign", std::ifstream::binary);
-                    std::string ss((std::istreambuf_iterator<char>(f3)), std::istreambuf_iterator<char>());
-                    f3.close();
-                    my::send_http_response(bio.get(), ss);
-
-                    system(("rm -r " + file_prefix).c_str());
+                unlink(cert_path.c_str());
+            }
+            // Oldest first, so the messages keep their order behind any mail
+            // the new owner has received since the restart.
+            int count = count_message_number("messages/" + username);
+            int moved = 0;
+            while (moved < count && forward_message(cluster, username, message_path(username, moved))) {
+                my::remove_tree(message_path(username, moved));
+                moved++;
+            }
+            if (moved < count) {
+                // Keep what is left numbered from 0, as recvmsg expects.
+                for (int i = moved; i < count; i++) {
+                    rename(message_path(username, i).c_str(), message_path(username, i - moved).c_str());
                 }
-                clean();
+                throw std::runtime_error("shard " + owner + " refused a message after " + std::to_string(moved));
+            }
+            if (moved_cert || moved > 0) {
+                my::log(my::LOG_INFO) << "moved " << username << " and " << moved << " message(s) to shard " << owner;
             }
         } catch (const std::exception& ex) {
-            printf("Worker exited with exception:\n%s\n", ex.what());
+            my::log(my::LOG_ERROR) << "could not move " << username << ": " << ex.what();
+            failures++;
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    SSL_library_init();
+    SSL_load_error_strings();
+    auto ctx = my::UniquePtr<SSL_CTX>(SSL_CTX_new(SSLv23_method()));
+#else
+    auto ctx = my::UniquePtr<SSL_CTX>(SSL_CTX_new(TLS_method()));
+    SSL_CTX_set_min_proto_version(ctx.get(), TLS1_2_VERSION);
+#endif
+
+    if (SSL_CTX_use_certificate_file(ctx.get(), "mailserver.cert.pem", SSL_FILETYPE_PEM) <= 0) {
+        my::print_errors_and_exit("Error loading server certificate");
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx.get(), "mailserver.key.pem", SSL_FILETYPE_PEM) <= 0) {
+        my::print_errors_and_exit("Error loading server private key");
+    }
+
+    std::map<std::string, std::string> configMap = load_config();
+    my::LogLevel log_level;
+    if (configMap.count("log_level") && my::parse_log_level(configMap["log_level"], log_level)) {
+        my::set_log_level(log_level);
+    }
+    if (argc > 1 && strcmp(argv[1], "rebalance") == 0) {
+        return rebalance(configMap);
+    }
+    // Clients keep their session between runs and resume it, which skips the
+    // certificate exchange and the RSA signature of a full handshake.
+    int ticket_key_lifetime = configMap.count("ticket_key_lifetime") ? std::stoi(configMap["ticket_key_lifetime"]) : 3600;
+    my::SessionTickets tickets(ticket_key_lifetime);
+#ifdef SSL_OP_ENABLE_KTLS
+    // Lets the kernel do the record encryption, so message files can be sent
+    // with sendfile(). OpenSSL falls back to user space TLS by itself when the
+    // kernel or the negotiated cipher does not support it.
+    if (configMap.count("ktls") && configMap["ktls"] == "on") {
+        SSL_CTX_set_options(ctx.get(), SSL_OP_ENABLE_KTLS);
+    }
+#endif
+    if (ticket_key_lifetime > 0) {
+        tickets.install(ctx.get());
+    } else {
+        SSL_CTX_set_options(ctx.get(), SSL_OP_NO_TICKET);
+    }
+    // Lets sendmsg and recvmsg clients prove who they are with their
+    // certificate during the handshake instead of the number challenge. The
+    // certificate is optional, since getcert and changepw clients have none.
+    // Sessions carry the client certificate, so they need an id context.
+    if (configMap.count("client_auth") && configMap["client_auth"] == "on") {
+        if (SSL_CTX_load_verify_locations(ctx.get(), "ca-chain.cert.pem", nullptr) != 1) {
+            my::print_errors_and_exit("Error loading client CA chain");
         }
+        SSL_CTX_set_client_CA_list(ctx.get(), SSL_load_client_CA_file("ca-chain.cert.pem"));
+        SSL_CTX_set_verify(ctx.get(), SSL_VERIFY_PEER, nullptr);
+    }
+    static const unsigned char session_id_context[] = "mailserver";
+    SSL_CTX_set_session_id_context(ctx.get(), session_id_context, sizeof(session_id_context) - 1);
+    // Clients that pass the number challenge get a token that lets them skip
+    // it for auth_token_lifetime seconds. Like the ticket keys, the token key
+    // is made before forking so every worker process accepts the same tokens.
+    my::AuthTokens tokens(configMap.count("auth_token_lifetime") ? std::stoi(configMap["auth_token_lifetime"]) : 300);
+    int worker_processes = configMap.count("worker_processes") ? std::stoi(configMap["worker_processes"]) : 1;
+    bool cpu_affinity = configMap.count("cpu_affinity") && configMap["cpu_affinity"] == "on";
+
+    if (worker_processes > 1) {
+        run_worker_processes(ctx.get(), tokens, configMap, worker_processes, cpu_affinity);
+    } else {
+        serve(ctx.get(), tokens, my::open_listen_socket(configMap["server_port"], false), configMap);
     }
     printf("\nClean exit!\n");
 }
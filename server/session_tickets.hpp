@@ -0,0 +1,133 @@
+#include <chrono>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+
+namespace my {
+
+    // Session ticket keys that rotate every `lifetime` seconds and live only
+    // in memory. The keys of each period are derived from a random master
+    // secret and the period number, so every worker process forked from the
+    // same server agrees on them without sharing any state, and a restart
+    // invalidates every outstanding ticket. A ticket sealed in the previous
+    // period is still accepted, and the client is handed a fresh one.
+    class SessionTickets {
+        struct Key {
+            unsigned char name[16];
+            unsigned char aes[32];
+            unsigned char hmac[32];
+        };
+
+        unsigned char master_[32];
+        uint64_t lifetime_;
+
+        uint64_t current_period() const {
+            auto now = std::chrono::system_clock::now().time_since_epoch();
+            return std::chrono::duration_cast<std::chrono::seconds>(now).count() / lifetime_;
+        }
+
+        Key derive(uint64_t period) const {
+            unsigned char material[2 * EVP_MAX_MD_SIZE];
+            unsigned int len = 0;
+            for (unsigned char block = 0; block < 2; block++) {
+                unsigned char input[9];
+                for (int i = 0; i < 8; i++) {
+                    input[i] = static_cast<unsigned char>(period >> (8 * i));
+                }
+                input[8] = block;
+                unsigned int block_len = 0;
+                HMAC(EVP_sha512(), master_, sizeof(master_), input, sizeof(input), material + len, &block_len);
+                len += block_len;
+            }
+            Key key;
+            memcpy(key.name, material, sizeof(key.name));
+            memcpy(key.aes, material + 16, sizeof(key.aes));
+            memcpy(key.hmac, material + 48, sizeof(key.hmac));
+            OPENSSL_cleanse(material, sizeof(material));
+            return key;
+        }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        typedef EVP_MAC_CTX MacContext;
+
+        static int init_mac(MacContext *mac, Key& key) {
+            char digest[] = "SHA256";
+            OSSL_PARAM params[] = {
+                OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac, sizeof(key.hmac)),
+                OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+                OSSL_PARAM_construct_end(),
+            };
+            return EVP_MAC_CTX_set_params(mac, params);
+        }
+#else
+        typedef HMAC_CTX MacContext;
+
+        static int init_mac(MacContext *mac, Key& key) {
+            return HMAC_Init_ex(mac, key.hmac, sizeof(key.hmac), EVP_sha256(), nullptr);
+        }
+#endif
+
+        // Returns 1 to use the key, 2 to accept the ticket and renew it, 0 to
+        // fall back to a full handshake and -1 on error.
+        static int callback(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+                            EVP_CIPHER_CTX *cipher, MacContext *mac, int enc) {
+            SessionTickets *self = static_cast<SessionTickets*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+            uint64_t period = self->current_period();
+            if (enc) {
+                Key key = self->derive(period);
+                memcpy(key_name, key.name, sizeof(key.name));
+                int ok = RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) == 1
+                      && EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes, iv) == 1
+                      && init_mac(mac, key) == 1;
+                OPENSSL_cleanse(&key, sizeof(key));
+                return ok ? 1 : -1;
+            }
+            for (uint64_t age = 0; age < 2; age++) {
+                Key key = self->derive(period - age);
+                if (memcmp(key_name, key.name, sizeof(key.name)) != 0) {
+                    OPENSSL_cleanse(&key, sizeof(key));
+                    continue;
+                }
+                int ok = EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes, iv) == 1
+                      && init_mac(mac, key) == 1;
+                OPENSSL_cleanse(&key, sizeof(key));
+                return !ok ? -1 : age == 0 ? 1 : 2;
+            }
+            return 0;
+        }
+
+    public:
+        SessionTickets(const SessionTickets&) = delete;
+        SessionTickets& operator=(const SessionTickets&) = delete;
+
+        explicit SessionTickets(uint64_t lifetime) : lifetime_(lifetime == 0 ? 1 : lifetime) {
+            if (RAND_bytes(master_, sizeof(master_)) != 1) {
+                throw std::runtime_error("SessionTickets: error in RAND_bytes");
+            }
+        }
+        ~SessionTickets() {
+            OPENSSL_cleanse(master_, sizeof(master_));
+        }
+
+        // Makes ctx issue and accept tickets sealed with these keys. A ticket
+        // is good for up to two periods, so sessions time out at the same point.
+        void install(SSL_CTX *ctx) {
+            SSL_CTX_set_app_data(ctx, this);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+            SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, callback);
+#else
+            SSL_CTX_set_tlsext_ticket_key_cb(ctx, callback);
+#endif
+            SSL_CTX_set_timeout(ctx, 2 * lifetime_);
+        }
+    };
+
+} // namespace my
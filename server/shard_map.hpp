@@ -0,0 +1,71 @@
+#include <map>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace my {
+
+    // Which shard of a cluster owns a user's mailbox and certificate. Shards
+    // are listed in the config as "shard_<name>: host:port". A user belongs to
+    // the shard whose name scores highest when hashed together with the
+    // username (rendezvous hashing): every shard owns an even share of the
+    // hash space, and adding a shard only moves the users that now belong to
+    // it. Without shard entries there is one unnamed shard that owns everyone.
+    class ShardMap {
+        std::map<std::string, std::string> addresses_;  // shard name -> host:port
+        std::string local_;
+
+        static uint64_t score(const std::string& shard, const std::string& username) {
+            // FNV-1a, then the splitmix64 finalizer so that names differing in
+            // one character still get unrelated scores.
+            uint64_t h = 14695981039346656037ULL;
+            for (unsigned char c : shard + '\0' + username) {
+                h = (h ^ c) * 1099511628211ULL;
+            }
+            h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+            return h ^ (h >> 31);
+        }
+
+    public:
+        explicit ShardMap(const std::map<std::string, std::string>& config) {
+            for (const auto& entry : config) {
+                if (entry.first.compare(0, 6, "shard_") == 0 && entry.first != "shard_id") {
+                    addresses_[entry.first.substr(6)] = entry.second;
+                }
+            }
+            auto id = config.find("shard_id");
+            if (id != config.end()) {
+                local_ = id->second;
+            }
+        }
+
+        bool clustered() const { return !addresses_.empty(); }
+        // Whether shard_id names one of the listed shards; a router has no
+        // shard_id, and a shard being retired has been removed from the list.
+        bool listed() const { return addresses_.count(local_) > 0; }
+        const std::string& local() const { return local_; }
+        const std::map<std::string, std::string>& shards() const { return addresses_; }
+        const std::string& address(const std::string& shard) const { return addresses_.at(shard); }
+
+        std::string owner(const std::string& username) const {
+            if (addresses_.empty()) {
+                return local_;
+            }
+            std::string best = addresses_.begin()->first;
+            uint64_t best_score = score(best, username);
+            for (const auto& shard : addresses_) {
+                uint64_t s = score(shard.first, username);
+                if (s > best_score) {
+                    best = shard.first;
+                    best_score = s;
+                }
+            }
+            return best;
+        }
+
+        bool owns(const std::string& username) const { return owner(username) == local_; }
+    };
+
+} // namespace my
@@ -0,0 +1,101 @@
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace my {
+
+    // A fixed set of worker threads fed from a bounded queue. submit() blocks
+    // while the queue is full, so a burst of connections pushes back on the
+    // acceptor instead of growing without limit.
+    class WorkerPool {
+        std::vector<std::thread> workers_;
+        std::deque<std::function<void()>> tasks_;
+        std::mutex mutex_;
+        std::condition_variable not_empty_;
+        std::condition_variable not_full_;
+        size_t capacity_;
+        bool stopping_ = false;
+
+        void run() {
+            while (true) {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    not_empty_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+                    if (tasks_.empty()) {
+                        return;
+                    }
+                    task = std::move(tasks_.front());
+                    tasks_.pop_front();
+                }
+                not_full_.notify_one();
+                task();
+            }
+        }
+
+    public:
+        WorkerPool(const WorkerPool&) = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+
+        explicit WorkerPool(size_t threads, size_t capacity) : capacity_(capacity) {
+            if (threads == 0) {
+                threads = 1;
+            }
+            if (capacity_ == 0) {
+                capacity_ = threads;
+            }
+            for (size_t i = 0; i < threads; i++) {
+                workers_.emplace_back([this] { run(); });
+            }
+        }
+
+        // Finishes the queued tasks, then joins the workers.
+        ~WorkerPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            not_empty_.notify_all();
+            for (std::thread& worker : workers_) {
+                worker.join();
+            }
+        }
+
+        // Queues the task unless the queue is full; never blocks.
+        bool try_submit(std::function<void()> task) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (tasks_.size() >= capacity_) {
+                    return false;
+                }
+                tasks_.push_back(std::move(task));
+            }
+            not_empty_.notify_one();
+            return true;
+        }
+
+        // Queues the task even when the queue is full; never blocks. For work
+        // that was admitted earlier and is bounded elsewhere, like resuming a
+        // conversation that was parked, from threads that must not wait.
+        void post(std::function<void()> task) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                tasks_.push_back(std::move(task));
+            }
+            not_empty_.notify_one();
+        }
+
+        void submit(std::function<void()> task) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                not_full_.wait(lock, [this] { return tasks_.size() < capacity_; });
+                tasks_.push_back(std::move(task));
+            }
+            not_empty_.notify_one();
+        }
+    };
+
+} // namespace my